@@ -67,6 +67,12 @@
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
 
+/*
+ * The reverse, for kseg0 addresses such as those handed out by
+ * alloc_kpages.
+ */
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
+
 /*
  * The top of user space. (Actually, the address immediately above the
  * last valid user address.)
@@ -110,19 +116,69 @@ paddr_t ram_stealmem(unsigned long npages);
 paddr_t ram_getsize(void);
 paddr_t ram_getfirstfree(void);
 
+/*
+ * Interface to the low-level module that looks after the TLB on
+ * behalf of the VM code (arch/mips/vm/mmu.c). Both dumbvm and the
+ * real VM system use it.
+ *
+ * mmu_map loads a translation for the user page VADDR to the
+ * physical page PADDR, replacing any existing entry for VADDR. If
+ * WRITEABLE is false the page is mapped read-only and writes will
+ * fault with VM_FAULT_READONLY.
+ *
+ * mmu_unmap drops the translation for VADDR from the current cpu's
+ * TLB, if there is one.
+ *
+ * mmu_flush drops all translations from the current cpu's TLB.
+ *
+ * mmu_newgen returns a fresh, never-zero generation number that
+ * identifies one version of an address space's mappings.
+ *
+ * mmu_activate makes the current cpu's TLB hold translations for
+ * generation GEN, flushing it only if it was last loaded for some
+ * other generation.
+ *
+ * mmu_shootdown invalidates NPAGES pages starting at VADDR for
+ * generation GEN, on this cpu and on every other cpu whose TLB is
+ * currently loaded for GEN, and waits for them to finish. Ranges
+ * longer than TLBSHOOTDOWN_MAX are done by flushing the whole
+ * generation. No spinlocks may be held.
+ *
+ * mmu_tlbshootdown carries out one shootdown request on the current
+ * cpu; it is the back end of vm_tlbshootdown.
+ *
+ * mmu_printstats prints per-cpu TLB miss and eviction counts.
+ */
+
+struct tlbshootdown;
+
+void mmu_map(vaddr_t vaddr, paddr_t paddr, bool writeable);
+void mmu_unmap(vaddr_t vaddr);
+void mmu_flush(void);
+uint32_t mmu_newgen(void);
+void mmu_activate(uint32_t gen);
+void mmu_shootdown(uint32_t gen, vaddr_t vaddr, unsigned npages);
+void mmu_tlbshootdown(const struct tlbshootdown *ts);
+void mmu_printstats(void);
+
 /*
  * TLB shootdown bits.
  *
+ * A shootdown names a TLB generation (see mmu_newgen) and either one
+ * page or, if ts_vaddr is TLBSHOOTDOWN_ALL, all of that generation's
+ * pages. A cpu whose TLB is loaded for some other generation has
+ * nothing to do.
+ *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	uint32_t ts_gen;		/* Address space generation */
+	vaddr_t ts_vaddr;		/* Page, or TLBSHOOTDOWN_ALL */
 };
 
+#define TLBSHOOTDOWN_ALL 0xffffffff
+
 #define TLBSHOOTDOWN_MAX 16
 
 
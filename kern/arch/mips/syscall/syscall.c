@@ -36,6 +36,7 @@
 #include <current.h>
 #include <syscall.h>
 #include <addrspace.h>
+#include <copyinout.h>
 #include <proc.h>
 
 
@@ -83,6 +84,8 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int status; // status of waitpid syscall
+	int mmap_fd; // mmap arguments passed on the user stack
+	off_t mmap_offset;
 	int err;
 
 	KASSERT(curthread != NULL);
@@ -177,12 +180,44 @@ syscall(struct trapframe *tf)
 						  &retval);
 		break;
 
+		case SYS_sbrk:
+		err = sys_sbrk((intptr_t) tf->tf_a0,		// amount
+					   &retval);					// retval = old break
+		break;
+
+		case SYS_mmap:
+		// fd is at sp+16; the 64-bit offset is aligned, at sp+24
+		err = copyin((const_userptr_t)(tf->tf_sp + 16), &mmap_fd, sizeof(int));
+		if (err) {
+			break;
+		}
+		err = copyin((const_userptr_t)(tf->tf_sp + 24), &mmap_offset, sizeof(off_t));
+		if (err) {
+			break;
+		}
+		err = sys_mmap((userptr_t)tf->tf_a0,			// addr (hint, ignored)
+					   (size_t)tf->tf_a1,			// len
+					   (int)tf->tf_a2,				// prot
+					   (int)tf->tf_a3,				// flags
+					   mmap_fd,						// fd
+					   mmap_offset,					// offset
+					   &retval);					// retval = mapping address
+		break;
+
+		case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0,		// addr
+						 (size_t)tf->tf_a1);		// len
+		break;
+
 		case SYS_execv:
 		err = sys_execv((char *)tf->tf_a0,
 						 (char **)tf->tf_a1);
+		break;
 
 		case SYS_getpid:
 		err = sys_getpid(&retval);					// retval: current process pid
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
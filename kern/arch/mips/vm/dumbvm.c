@@ -37,6 +37,9 @@
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
+#include <coremap.h>
+#include <pagecache.h>
+#include <objcache.h>
 #include <vm.h>
 
 /*
@@ -59,15 +62,10 @@
 /* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
 #define DUMBVM_STACKPAGES    18
 
-/*
- * Wrap ram_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	coremap_bootstrap();
 }
 
 /*
@@ -90,18 +88,25 @@ dumbvm_can_sleep(void)
 	}
 }
 
+/*
+ * Physical pages come from the coremap, which falls back to
+ * ram_stealmem before vm_bootstrap has run. File reads fill the page
+ * cache, so when memory runs out drop unused cached pages (and unused
+ * object cache slabs) and retry.
+ */
 static
 paddr_t
 getppages(unsigned long npages)
 {
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
-
-	addr = ram_stealmem(npages);
+	paddr_t pa;
 
-	spinlock_release(&stealmem_lock);
-	return addr;
+	while ((pa = coremap_alloc(npages)) == 0) {
+		if (pagecache_reclaim(npages) == 0 &&
+		    objcache_reclaim() == 0) {
+			break;
+		}
+	}
+	return pa;
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -121,9 +126,8 @@ alloc_kpages(unsigned npages)
 void
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
-
-	(void)addr;
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	coremap_free(KVADDR_TO_PADDR(addr));
 }
 
 void
@@ -133,15 +137,26 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+void
+vm_tlbshootdown_all(void)
+{
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+bool
+vm_idle(void)
+{
+	/* Nothing to do in the background. */
+	return false;
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
+	bool writeable;
 	struct addrspace *as;
-	int spl;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -149,8 +164,11 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("dumbvm: got VM_FAULT_READONLY\n");
+		/*
+		 * Write to a page of a segment that isn't writeable
+		 * (we only map those read-only). Kill the process.
+		 */
+		return EFAULT;
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -199,12 +217,15 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
+		writeable = as->as_writeable1;
 	}
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
 		paddr = (faultaddress - vbase2) + as->as_pbase2;
+		writeable = as->as_writeable2;
 	}
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
+		writeable = true;
 	}
 	else {
 		return EFAULT;
@@ -213,25 +234,15 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
-		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
+	/* load_elf has to write the segments in, whatever they allow. */
+	if (as->as_loading) {
+		writeable = true;
 	}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
+	/* Load it, replacing an old entry if the TLB is full. */
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	mmu_map(faultaddress, paddr, writeable);
+	return 0;
 }
 
 struct addrspace *
@@ -245,10 +256,14 @@ as_create(void)
 	as->as_vbase1 = 0;
 	as->as_pbase1 = 0;
 	as->as_npages1 = 0;
+	as->as_writeable1 = true;
 	as->as_vbase2 = 0;
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
+	as->as_writeable2 = true;
 	as->as_stackpbase = 0;
+	as->as_loading = false;
+	as->as_gen = mmu_newgen();
 
 	return as;
 }
@@ -257,13 +272,23 @@ void
 as_destroy(struct addrspace *as)
 {
 	dumbvm_can_sleep();
+
+	/* Any of these may be 0 if as_prepare_load failed partway. */
+	if (as->as_pbase1 != 0) {
+		coremap_free(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		coremap_free(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		coremap_free(as->as_stackpbase);
+	}
 	kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -271,14 +296,8 @@ as_activate(void)
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	/* Flushes only if this cpu last ran some other address space. */
+	mmu_activate(as->as_gen);
 }
 
 void
@@ -304,20 +323,21 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
-	/* We don't use these - all pages are read-write */
+	/* Only write permission can be enforced. */
 	(void)readable;
-	(void)writeable;
 	(void)executable;
 
 	if (as->as_vbase1 == 0) {
 		as->as_vbase1 = vaddr;
 		as->as_npages1 = npages;
+		as->as_writeable1 = writeable != 0;
 		return 0;
 	}
 
 	if (as->as_vbase2 == 0) {
 		as->as_vbase2 = vaddr;
 		as->as_npages2 = npages;
+		as->as_writeable2 = writeable != 0;
 		return 0;
 	}
 
@@ -363,6 +383,8 @@ as_prepare_load(struct addrspace *as)
 	as_zero_region(as->as_pbase2, as->as_npages2);
 	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
 
+	as->as_loading = true;
+
 	return 0;
 }
 
@@ -370,7 +392,16 @@ int
 as_complete_load(struct addrspace *as)
 {
 	dumbvm_can_sleep();
-	(void)as;
+
+	/*
+	 * Stop treating everything as writeable, and get rid of the
+	 * writeable TLB entries made while loading: a new generation
+	 * flushes them. Only this thread has run this address space.
+	 */
+	as->as_loading = false;
+	as->as_gen = mmu_newgen();
+	mmu_activate(as->as_gen);
+
 	return 0;
 }
 
@@ -383,6 +414,40 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	/* dumbvm allocates everything up front and has no heap. */
+	(void)as;
+	(void)amount;
+	(void)oldbreak;
+	return ENOSYS;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+	int prot, bool shared, vaddr_t *ret)
+{
+	/* Nor can it map files. */
+	(void)as;
+	(void)v;
+	(void)offset;
+	(void)len;
+	(void)prot;
+	(void)shared;
+	(void)ret;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	return ENOSYS;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -397,14 +462,17 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 
 	new->as_vbase1 = old->as_vbase1;
 	new->as_npages1 = old->as_npages1;
+	new->as_writeable1 = old->as_writeable1;
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
+	new->as_writeable2 = old->as_writeable2;
 
 	/* (Mis)use as_prepare_load to allocate some physical memory. */
 	if (as_prepare_load(new)) {
 		as_destroy(new);
 		return ENOMEM;
 	}
+	new->as_loading = false;
 
 	KASSERT(new->as_pbase1 != 0);
 	KASSERT(new->as_pbase2 != 0);
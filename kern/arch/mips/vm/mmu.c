@@ -0,0 +1,284 @@
+/*
+ * MIPS TLB management for the VM system.
+ *
+ * The TLB is software-refilled: vm_fault works out the translation
+ * and calls mmu_map to load it. Interrupts are turned off on the
+ * current cpu while the TLB is being changed so that a context switch
+ * in the middle cannot mix up two address spaces' entries.
+ *
+ * When a new entry is needed, slots are replaced round-robin. After a
+ * flush the victim pointer starts again at slot 0, so the invalid
+ * slots are used up first and after that the oldest entry loaded is
+ * the one that goes. The hardware gives us no reference bits, so
+ * this FIFO order is about as good as we can cheaply do, and unlike
+ * scanning for an invalid slot it costs the same on every miss.
+ *
+ * Each cpu keeps its own victim pointer and counters, indexed by cpu
+ * number; they are only touched by that cpu with interrupts off.
+ *
+ * There are no ASIDs in use, so the TLB can only hold one address
+ * space's translations at a time. Rather than flushing on every
+ * context switch, each cpu remembers the generation number of the
+ * address space its TLB was loaded for, and mmu_activate only flushes
+ * when a different one comes along. Switching to a kernel thread and
+ * back to the same process, or between threads of one process, costs
+ * nothing. Generation numbers come from a global counter and are
+ * never reused (short of wrapping 32 bits), so a freed address space
+ * whose memory is recycled for a new one can't inherit its TLB
+ * contents. An address space that has to revoke mappings wholesale
+ * (e.g. fork making everything copy-on-write) takes a new generation,
+ * which makes every cpu that still holds the old one flush lazily the
+ * next time it switches to it. Single-page changes use mmu_unmap and
+ * leave the rest of the TLB alone.
+ *
+ * The same bookkeeping makes TLB shootdowns targeted: mmu_shootdown
+ * only interrupts cpus whose TLB is loaded for the generation being
+ * changed. A cpu that ran the address space earlier but has since
+ * switched away will flush anyway before it uses it again. All the
+ * pages for one target go in a single IPI; if there are more than
+ * TLBSHOOTDOWN_MAX, a whole-generation flush is sent instead.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <membar.h>
+#include <platform/maxcpus.h>
+#include <vm.h>
+
+struct mmu_cpustate {
+	struct cpu *ms_cpu;		/* Owning cpu, once it has run a user as */
+	unsigned ms_next;		/* Next slot to replace */
+	uint32_t ms_gen;		/* Whose entries are loaded; 0 = none */
+	unsigned ms_misses;		/* New entries loaded */
+	unsigned ms_evictions;		/* ...that replaced a valid entry */
+	unsigned ms_flushes;		/* Whole-TLB flushes */
+	unsigned ms_kept;		/* Switches that didn't need a flush */
+	unsigned ms_shootdowns;		/* Shootdowns received */
+};
+
+static struct mmu_cpustate mmu_cpus[MAXCPUS];
+
+static struct spinlock mmu_genlock = SPINLOCK_INITIALIZER;
+static uint32_t mmu_nextgen = 1;
+
+/*
+ * Invalidate the whole TLB on the current cpu. Interrupts must be off.
+ */
+static
+void
+mmu_invalidate(struct mmu_cpustate *ms)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	ms->ms_next = 0;
+	ms->ms_flushes++;
+}
+
+uint32_t
+mmu_newgen(void)
+{
+	uint32_t gen;
+
+	spinlock_acquire(&mmu_genlock);
+	gen = mmu_nextgen++;
+	if (mmu_nextgen == 0) {
+		/* 0 means "nothing loaded"; don't hand it out. */
+		mmu_nextgen = 1;
+	}
+	spinlock_release(&mmu_genlock);
+	return gen;
+}
+
+void
+mmu_activate(uint32_t gen)
+{
+	struct mmu_cpustate *ms;
+	int spl;
+
+	KASSERT(gen != 0);
+
+	spl = splhigh();
+	ms = &mmu_cpus[curcpu->c_number];
+	ms->ms_cpu = curcpu;
+	if (ms->ms_gen == gen) {
+		ms->ms_kept++;
+	}
+	else {
+		mmu_invalidate(ms);
+		ms->ms_gen = gen;
+		/* Publish before loading any entries; see mmu_shootdown. */
+		membar_any_any();
+	}
+	splx(spl);
+}
+
+/*
+ * Carry out one shootdown on the current cpu. Interrupts are off
+ * (we're in the IPI handler or at splhigh).
+ */
+void
+mmu_tlbshootdown(const struct tlbshootdown *ts)
+{
+	struct mmu_cpustate *ms;
+	int index;
+
+	ms = &mmu_cpus[curcpu->c_number];
+	ms->ms_shootdowns++;
+	if (ms->ms_gen != ts->ts_gen) {
+		/* Not loaded here; nothing stale to remove. */
+		return;
+	}
+	if (ts->ts_vaddr == TLBSHOOTDOWN_ALL) {
+		mmu_invalidate(ms);
+		return;
+	}
+	index = tlb_probe(ts->ts_vaddr, 0);
+	if (index >= 0) {
+		tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+	}
+}
+
+void
+mmu_shootdown(uint32_t gen, vaddr_t vaddr, unsigned npages)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	struct cpu *targets[MAXCPUS];
+	struct mmu_cpustate *ms;
+	unsigned i, n, ntargets;
+	int spl;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	if (npages > TLBSHOOTDOWN_MAX) {
+		ts[0].ts_gen = gen;
+		ts[0].ts_vaddr = TLBSHOOTDOWN_ALL;
+		n = 1;
+	}
+	else {
+		for (n=0; n<npages; n++) {
+			ts[n].ts_gen = gen;
+			ts[n].ts_vaddr = vaddr + n * PAGE_SIZE;
+		}
+	}
+
+	/*
+	 * The caller has already changed the page table. A cpu that
+	 * picks up GEN after we look at it here will only load the
+	 * new entries, so it doesn't need to be told.
+	 */
+	membar_any_any();
+
+	ntargets = 0;
+	spl = splhigh();
+	for (i=0; i<n; i++) {
+		mmu_tlbshootdown(&ts[i]);
+	}
+	for (i=0; i<MAXCPUS; i++) {
+		ms = &mmu_cpus[i];
+		if (ms->ms_cpu == NULL || ms->ms_cpu == curcpu ||
+		    ms->ms_gen != gen) {
+			continue;
+		}
+		ipi_tlbshootdown_many(ms->ms_cpu, ts, n);
+		targets[ntargets++] = ms->ms_cpu;
+	}
+	splx(spl);
+
+	for (i=0; i<ntargets; i++) {
+		ipi_tlbshootdown_wait(targets[i]);
+	}
+}
+
+void
+mmu_map(vaddr_t vaddr, paddr_t paddr, bool writeable)
+{
+	struct mmu_cpustate *ms;
+	uint32_t ehi, elo, oldehi, oldelo;
+	int spl, index;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(vaddr < USERSPACETOP);
+
+	ehi = vaddr;
+	elo = paddr | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	spl = splhigh();
+	ms = &mmu_cpus[curcpu->c_number];
+
+	/* Never load two entries for the same page. */
+	index = tlb_probe(ehi, 0);
+	if (index < 0) {
+		index = ms->ms_next;
+		ms->ms_next = (ms->ms_next + 1) % NUM_TLB;
+		ms->ms_misses++;
+
+		tlb_read(&oldehi, &oldelo, index);
+		if (oldelo & TLBLO_VALID) {
+			ms->ms_evictions++;
+		}
+	}
+	tlb_write(ehi, elo, index);
+
+	splx(spl);
+}
+
+void
+mmu_unmap(vaddr_t vaddr)
+{
+	int spl, index;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	spl = splhigh();
+	index = tlb_probe(vaddr, 0);
+	if (index >= 0) {
+		tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+	}
+	splx(spl);
+}
+
+void
+mmu_flush(void)
+{
+	struct mmu_cpustate *ms;
+	int spl;
+
+	spl = splhigh();
+	ms = &mmu_cpus[curcpu->c_number];
+	mmu_invalidate(ms);
+	splx(spl);
+}
+
+/*
+ * Print the per-cpu TLB counters. They are read without locking, so
+ * they may be slightly stale for other cpus.
+ */
+void
+mmu_printstats(void)
+{
+	struct mmu_cpustate *ms;
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		ms = &mmu_cpus[i];
+		if (ms->ms_misses == 0 && ms->ms_flushes == 0) {
+			continue;
+		}
+		kprintf("  cpu%u: %u tlb misses, %u evictions, %u flushes, "
+			"%u switches without flush, %u shootdowns\n",
+			i, ms->ms_misses, ms->ms_evictions, ms->ms_flushes,
+			ms->ms_kept, ms->ms_shootdowns);
+	}
+}
@@ -53,6 +53,7 @@
 #include <platform/bus.h>
 #include <vfs.h>
 #include <emufs.h>
+#include <pagecache.h>
 #include "autoconf.h"
 
 /* Register offsets */
@@ -499,6 +500,9 @@ emufs_reclaim(struct vnode *v)
 	 */
 	spinlock_release(&ev->ev_v.vn_countlock);
 
+	/* Cached pages don't hold the vnode; drop them before it goes. */
+	pagecache_purge(v);
+
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
@@ -597,9 +601,10 @@ int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	off_t pos = uio->uio_offset;
 	uint32_t amt;
 	size_t oldresid;
-	int result;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
@@ -613,7 +618,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
 		if (result) {
-			return result;
+			break;
 		}
 
 		if (uio->uio_resid == oldresid) {
@@ -622,7 +627,10 @@ emufs_write(struct vnode *v, struct uio *uio)
 		}
 	}
 
-	return 0;
+	/* Cached copies of what we wrote are stale. */
+	pagecache_invalidate(v, pos, uio->uio_offset - pos);
+
+	return result;
 }
 
 /*
@@ -725,7 +733,12 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	/* Drop the cached pages after the file shrinks, not before. */
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	pagecache_truncate(v, len);
+	return result;
 }
 
 /*
@@ -845,13 +858,16 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Mapped pages come from the page cache, filled with emufs_read.
+ * Unlike SFS, read() and write() go straight to the host and don't
+ * use the cache; write() just drops any cached pages it overlaps.
  */
 static
 int
-emufs_mmap(struct vnode *v)
+emufs_mmap(struct vnode *v, off_t offset, paddr_t *ret)
 {
-	(void)v;
-	return ENOSYS;
+	return pagecache_getpage(v, offset, emufs_read, ret);
 }
 
 //////////////////////////////
@@ -1121,7 +1137,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_gettype = emufs_dir_gettype,
 	.vop_isseekable = emufs_isseekable,
 	.vop_fsync = emufs_void_op_isdir,
-	.vop_mmap = emufs_void_op_isdir,
+	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = emufs_truncate_isdir,
 	.vop_namefile = emufs_namefile,
 
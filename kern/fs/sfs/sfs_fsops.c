@@ -42,6 +42,7 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <objcache.h>
 #include "sfsprivate.h"
 
 
@@ -263,6 +264,7 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 		bitmap_destroy(sfs->sfs_freemap);
 	}
 	vnodearray_destroy(sfs->sfs_vnodes);
+	objcache_destroy(sfs->sfs_vnodecache);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -355,6 +357,20 @@ sfs_fs_create(void)
 	if (sfs->sfs_vnodes == NULL) {
 		goto cleanup_object;
 	}
+	/*
+	 * sfs_vnodes have nothing that stays the same while free:
+	 * vnode_init and vnode_cleanup set up and tear down the whole
+	 * abstract vnode on every load and reclaim, and the rest is
+	 * read from disk. So there's no constructor or destructor; the
+	 * cache just keeps the vnodes of a volume together on a few
+	 * pages and out of kmalloc.
+	 */
+	sfs->sfs_vnodecache = objcache_create("sfs_vnode",
+					      sizeof(struct sfs_vnode),
+					      NULL, NULL);
+	if (sfs->sfs_vnodecache == NULL) {
+		goto cleanup_vnodes;
+	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
@@ -362,6 +378,8 @@ sfs_fs_create(void)
 
 	return sfs;
 
+cleanup_vnodes:
+	vnodearray_destroy(sfs->sfs_vnodes);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -37,6 +37,8 @@
 #include <lib.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <objcache.h>
+#include <pagecache.h>
 #include "sfsprivate.h"
 
 
@@ -93,6 +95,18 @@ sfs_reclaim(struct vnode *v)
 	}
 	spinlock_release(&v->vn_countlock);
 
+	/*
+	 * Drop the file's cached pages, which don't hold a reference to
+	 * the vnode. Write back any that are still dirty first, unless
+	 * the file is about to be erased. Nothing maps the file (that
+	 * would hold a reference), so there's nobody to report a failure
+	 * to.
+	 */
+	if (sv->sv_i.sfi_linkcount > 0) {
+		(void)pagecache_sync(v);
+	}
+	pagecache_purge(v);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
@@ -136,7 +150,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	objcache_free(sfs->sfs_vnodecache, sv);
 
 	/* Done */
 	return 0;
@@ -184,7 +198,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = objcache_alloc(sfs->sfs_vnodecache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -198,7 +212,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		objcache_free(sfs->sfs_vnodecache, sv);
 		return result;
 	}
 
@@ -235,7 +249,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		objcache_free(sfs->sfs_vnodecache, sv);
 		return result;
 	}
 
@@ -246,7 +260,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
+		objcache_free(sfs->sfs_vnodecache, sv);
 		return result;
 	}
 
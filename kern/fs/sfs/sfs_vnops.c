@@ -40,6 +40,9 @@
 #include <uio.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagecache.h>
 #include "sfsprivate.h"
 
 ////////////////////////////////////////////////////////////
@@ -91,38 +94,155 @@ sfs_eachopendir(struct vnode *v, int openflags)
 }
 
 /*
- * Called for read(). sfs_io() does the work.
+ * File data goes through the page cache: read() copies out of cached
+ * pages, and write() updates any cached page in place as well as
+ * writing through to disk. Since mmap() maps the same pages, mapped
+ * and read()/write() views of a file always agree.
+ */
+
+/*
+ * Read a page for the page cache straight from disk.
  */
 static
 int
-sfs_read(struct vnode *v, struct uio *uio)
+sfs_fillpage(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	return sfs_io(sv, uio);
+}
+
+/*
+ * Get the cached page at OFFSET, reading it in if needed. This holds
+ * the big lock across the read and the insertion into the cache, so a
+ * write can't slip in between and leave a stale page cached.
+ */
+static
+int
+sfs_getpage(struct vnode *v, off_t offset, paddr_t *ret)
+{
 	int result;
 
+	vfs_biglock_acquire();
+	result = pagecache_getpage(v, offset, sfs_fillpage, ret);
+	vfs_biglock_release();
+
+	return result;
+}
+
+/*
+ * Called for read(). Copies out of the page cache a page at a time.
+ * The big lock is held throughout so the file can't be truncated
+ * under us while we look at its size.
+ */
+static
+int
+sfs_read(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	paddr_t paddr;
+	off_t pos;
+	size_t skip, len;
+	int result = 0;
+
 	KASSERT(uio->uio_rw==UIO_READ);
 
 	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
+	while (uio->uio_resid > 0 &&
+	       uio->uio_offset < (off_t)sv->sv_i.sfi_size) {
+		pos = uio->uio_offset;
+		skip = pos % PAGE_SIZE;
+		len = PAGE_SIZE - skip;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		if ((off_t)len > sv->sv_i.sfi_size - pos) {
+			len = sv->sv_i.sfi_size - pos;
+		}
+
+		result = sfs_getpage(v, pos - skip, &paddr);
+		if (result) {
+			break;
+		}
+		result = uiomove((char *)PADDR_TO_KVADDR(paddr) + skip,
+				 len, uio);
+		coremap_free(paddr);
+		if (result) {
+			break;
+		}
+	}
 	vfs_biglock_release();
 
 	return result;
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Called for write(). sfs_io() writes through to disk; any cached
+ * copy of the page is updated first, so readers and shared mappings
+ * see the new data. If the write doesn't make it to disk, the cached
+ * bytes are read back from disk (or, failing that, the page is
+ * dropped) so the cache never shows data the file doesn't have.
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	struct iovec iov;
+	struct uio ku;
+	paddr_t paddr;
+	char *kpage;
+	off_t pos;
+	size_t skip, len, resid;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
 	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
+	while (uio->uio_resid > 0) {
+		pos = uio->uio_offset;
+		skip = pos % PAGE_SIZE;
+		len = PAGE_SIZE - skip;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		paddr = pagecache_get(v, pos - skip);
+		if (paddr != 0) {
+			kpage = (char *)PADDR_TO_KVADDR(paddr);
+			result = uiomove(kpage + skip, len, uio);
+			if (result == 0) {
+				uio_kinit(&iov, &ku, kpage + skip, len, pos,
+					  UIO_WRITE);
+				result = sfs_io(sv, &ku);
+			}
+			if (result) {
+				uio_kinit(&iov, &ku, kpage + skip, len, pos,
+					  UIO_READ);
+				if (sfs_io(sv, &ku)) {
+					pagecache_invalidate(v, pos - skip,
+							     PAGE_SIZE);
+				}
+				else {
+					/* Past EOF reads as zeros. */
+					bzero(kpage + skip + len - ku.uio_resid,
+					      ku.uio_resid);
+				}
+			}
+			coremap_free(paddr);
+		}
+		else {
+			/* Not cached; write just this page's worth. */
+			resid = uio->uio_resid;
+			uio->uio_resid = len;
+			result = sfs_io(sv, uio);
+			uio->uio_resid += resid - len;
+		}
+		if (result) {
+			break;
+		}
+	}
 	vfs_biglock_release();
 
 	return result;
@@ -224,6 +344,12 @@ sfs_fsync(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
+	/* Pages changed through shared mappings first. */
+	result = pagecache_sync(v);
+	if (result) {
+		return result;
+	}
+
 	vfs_biglock_acquire();
 	result = sfs_sync_inode(sv);
 	vfs_biglock_release();
@@ -232,26 +358,33 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(), and by the VM system to fill in mapped pages.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v, off_t offset, paddr_t *ret)
 {
-	(void)v;
-	return ENOSYS;
+	return sfs_getpage(v, offset, ret);
 }
 
 /*
- * Truncate a file.
+ * Truncate a file. The cached pages past the new end are dropped only
+ * after the blocks are gone, and under the same hold of the big lock,
+ * so sfs_getpage can't cache one of them again from the old blocks.
  */
 static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	int result;
 
-	return sfs_itrunc(sv, len);
+	vfs_biglock_acquire();
+	result = sfs_itrunc(sv, len);
+	pagecache_truncate(v, len);
+	vfs_biglock_release();
+
+	return result;
 }
 
 /*
@@ -412,6 +545,14 @@ sfs_remove(struct vnode *dir, const char *name)
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+
+		/*
+		 * Once nothing can open the file again there's no
+		 * point keeping its cached pages.
+		 */
+		if (victim->sv_i.sfi_linkcount == 0) {
+			pagecache_truncate(&victim->sv_absvn, 0);
+		}
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
@@ -36,32 +36,89 @@
 
 
 #include <vm.h>
+#include <spinlock.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
 
 
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
  *
- * You write this.
+ * Under the real VM system an address space is a list of regions,
+ * which say which virtual pages may be touched, plus a page table
+ * that says which of those pages have physical frames. Frames are
+ * allocated lazily, by vm_fault, the first time a page is touched.
+ *
+ * Part of a region may be backed by a file (a program segment): the
+ * bytes from rg_filestart to rg_fileend come from rg_vnode starting
+ * at rg_fileoff, and are read in a page at a time on first touch.
+ * Everything else in the region starts out zero.
+ *
+ * Each region has read, write and execute permissions (RG_READ etc).
+ * Pages of regions that aren't writable are never mapped with the TLB
+ * dirty bit, so a write to one faults and the process gets EFAULT.
+ *
+ * Regions made by mmap are file-backed the same way. A MAP_SHARED
+ * one (RG_SHARED) maps the file's page cache pages themselves, so
+ * writes to it go to the file; see pagecache.h.
  */
 
+#if !OPT_DUMBVM
+struct region {
+        vaddr_t rg_vbase;               /* Base address (page aligned) */
+        size_t rg_npages;               /* Length in pages */
+        struct vnode *rg_vnode;         /* Backing file, or NULL */
+        off_t rg_fileoff;               /* File offset of rg_filestart */
+        vaddr_t rg_filestart;           /* First file-backed address */
+        vaddr_t rg_fileend;             /* End of file-backed part */
+        int rg_flags;                   /* RG_* flags below */
+        vaddr_t rg_lastfault;           /* Last page faulted (fault-around) */
+        struct region *rg_next;         /* Next region in address space */
+};
+
+/* Values for rg_flags */
+#define RG_MMAP         0x1             /* Made by mmap */
+#define RG_SHARED       0x2             /* Maps page cache pages directly */
+#define RG_READ         0x4             /* May be read */
+#define RG_WRITE        0x8             /* May be written */
+#define RG_EXEC         0x10            /* May be executed */
+#endif
+
 struct addrspace {
 #if OPT_DUMBVM
         vaddr_t as_vbase1;
         paddr_t as_pbase1;
         size_t as_npages1;
+        bool as_writeable1;
         vaddr_t as_vbase2;
         paddr_t as_pbase2;
         size_t as_npages2;
+        bool as_writeable2;
         paddr_t as_stackpbase;
+        bool as_loading;                /* In load_elf; all writeable */
 #else
-        /* Put stuff here for your VM system */
+        struct region *as_regions;      /* Segments, stack, etc. */
+        struct region *as_stack;        /* Stack region (also in list) */
+        struct region *as_heap;         /* Heap region (also in list) */
+        vaddr_t as_heapend;             /* Current break (sbrk) */
+        struct pagetable *as_pt;        /* Virtual to physical mappings */
+        struct spinlock as_ptlock;      /* Protects the entries in as_pt */
 #endif
+        uint32_t as_gen;                /* TLB generation (mmu_newgen) */
 };
 
+/*
+ * User stack size under the real VM system. The stack region starts
+ * out USERSTACK_INITPAGES long and grows down a page at a time, as it
+ * is touched, up to USERSTACK_MAXPAGES. This must be > 64K so argument
+ * blocks of size ARG_MAX will fit.
+ */
+#define USERSTACK_INITPAGES     2
+#define USERSTACK_MAXPAGES      1024
+
 /*
  * Functions in addrspace.c:
  *
@@ -93,12 +150,44 @@ struct addrspace {
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Under the real VM system, this also sets
+ *                up an empty heap above the loaded segments.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_findregion - return the region containing VADDR, or NULL.
+ *                (Not available under dumbvm.)
+ *
+ *    as_growstack - if VADDR is below the stack region but within its
+ *                size limit and not in any other region, extend the
+ *                stack down to include it and return it; otherwise
+ *                return NULL. (Not available under dumbvm.)
+ *
+ *    as_define_file - arrange for the region containing VADDR, which
+ *                must already be defined, to be filled from FILESIZE
+ *                bytes of V at OFFSET, starting at VADDR, when its
+ *                pages are first touched. The rest of MEMSIZE is zero.
+ *                Takes a reference to V. (Not available under dumbvm.)
+ *
+ *    as_mmap   - map LEN bytes of V from page-aligned OFFSET at an
+ *                address of the kernel's choosing, below the space
+ *                kept for the stack, and return it in RET. PROT is
+ *                the PROT_* access allowed. If SHARED, writes go to
+ *                the file; otherwise they are private.
+ *                Takes a reference to V. (Returns ENOSYS under dumbvm.)
+ *
+ *    as_munmap - remove the mapping made by as_mmap at VADDR, which
+ *                must be LEN bytes long (rounded up to whole pages).
+ *                Pages changed through a shared mapping are written
+ *                back. (Returns ENOSYS under dumbvm.)
+ *
+ *    as_sbrk   - move the heap break by AMOUNT bytes and return the
+ *                old break in OLDBREAK. New heap pages are allocated
+ *                on first touch; pages given back are freed at once.
+ *                (Returns ENOSYS under dumbvm.)
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -117,6 +206,20 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+
+#if !OPT_DUMBVM
+struct region    *as_findregion(struct addrspace *as, vaddr_t vaddr);
+struct region    *as_growstack(struct addrspace *as, vaddr_t vaddr);
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t memsize, size_t filesize);
+#endif
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          off_t offset, size_t len, int prot, bool shared,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
 
 
 /*
@@ -0,0 +1,109 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page allocator (coremap).
+ *
+ * The coremap has one entry for every physical page frame in the
+ * machine. It is set up by coremap_bootstrap(), which takes over the
+ * memory that ram_getfirstfree() reports as unused; pages handed out
+ * by ram_stealmem() before that point are recorded as fixed and are
+ * never reused.
+ *
+ *    coremap_bootstrap - take over physical memory. Call once from
+ *                vm_bootstrap().
+ *
+ *    coremap_alloc - allocate NPAGES physically contiguous pages.
+ *                Returns the physical address of the first page, or
+ *                0 if no run of that length is free. The run starts
+ *                on a boundary of the next power of two pages at or
+ *                above NPAGES, and can be at most 2^COREMAP_MAXORDER
+ *                pages long. Safe to call before coremap_bootstrap(),
+ *                in which case the pages come from ram_stealmem() and
+ *                can never be freed.
+ *
+ *    coremap_free - drop a reference to a run previously returned by
+ *                coremap_alloc. When the last reference goes the whole
+ *                run is freed, and merged back with any free memory
+ *                around it. PADDR must be the address of its first
+ *                page.
+ *
+ *    coremap_share - add a reference to a single-page allocation, so
+ *                it can be mapped by more than one address space
+ *                (copy-on-write). Each reference is dropped with
+ *                coremap_free.
+ *
+ *    coremap_refcount - return the number of references to PADDR.
+ *                If this is 1, the caller holds the only one.
+ *
+ *    coremap_printstats - print page usage counts.
+ *
+ * Frames holding private user pages can be reclaimed by paging them
+ * out (see swap.h). The coremap keeps track of them for this:
+ *
+ *    coremap_setowner - record that PADDR holds the page at VADDR in
+ *                AS, and nobody else's. This makes it pageable. It
+ *                stops being pageable when it is freed or shared.
+ *
+ *    coremap_touch - note that PADDR has just been referenced.
+ *
+ *    coremap_pickvictims - choose up to MAX pageable frames, by clock
+ *                order, and mark them busy. Each gets an extra
+ *                reference, which keeps it allocated even if its owner
+ *                frees it meanwhile. Returns how many were chosen.
+ *
+ *    coremap_unpick - clear the busy mark of a frame returned by
+ *                coremap_pickvictims and drop the extra reference.
+ *
+ * Single-page allocations and frees normally go through a small
+ * per-cpu cache of free pages (struct coremap_cpucache, embedded in
+ * struct cpu) and only touch the shared coremap lock when the cache
+ * has to be refilled from, or drained back to, the global pool. This
+ * is done COREMAP_CPUCACHE_BATCH pages at a time.
+ *
+ *    coremap_cpucache_init - set up the page cache for a new cpu.
+ *                Called from cpu_create().
+ */
+
+#include <vm.h>
+
+struct addrspace;
+
+#define COREMAP_MAXORDER	10	/* Largest run is 2^10 pages */
+#define COREMAP_CPUCACHE_MAX	32	/* Most pages a cpu may hold */
+#define COREMAP_CPUCACHE_BATCH	16	/* Pages moved per refill/drain */
+
+struct coremap_cpucache {
+	paddr_t cc_pages[COREMAP_CPUCACHE_MAX];	/* Cached free pages */
+	unsigned cc_count;		/* Number of entries in cc_pages */
+	unsigned cc_cpunum;		/* Owning cpu, for stats */
+	struct coremap_cpucache *cc_next; /* All caches, for stats */
+
+	/* Statistics */
+	unsigned cc_hits;		/* Allocations served locally */
+	unsigned cc_misses;		/* Allocations that found it empty */
+	unsigned cc_refills;		/* Batches taken from global pool */
+	unsigned cc_drains;		/* Batches returned to global pool */
+};
+
+void coremap_cpucache_init(struct coremap_cpucache *cc, unsigned cpunum);
+
+struct coremap_victim {
+	paddr_t cv_paddr;		/* Frame */
+	struct addrspace *cv_as;	/* Owner */
+	vaddr_t cv_vaddr;		/* Page it holds */
+};
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned long npages);
+void coremap_free(paddr_t paddr);
+void coremap_share(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+void coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void coremap_touch(paddr_t paddr);
+unsigned coremap_pickvictims(struct coremap_victim *victims, unsigned max);
+void coremap_unpick(paddr_t paddr);
+void coremap_printstats(void);
+
+
+#endif /* _COREMAP_H_ */
@@ -34,6 +34,12 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <coremap.h>     /* for struct coremap_cpucache */
+#include <kmalloc.h>     /* for struct kmalloc_cpucache */
+
+
+/* Number of scheduler priority levels (run queues per cpu). */
+#define SCHED_NLEVELS	4
 
 
 /*
@@ -62,12 +68,24 @@ struct cpu {
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * (Statistics are read by others without locking.)
+	 */
+	struct coremap_cpucache c_pagecache; /* Free physical pages */
+	struct kmalloc_cpucache c_kmcache; /* Free kmalloc blocks */
+	struct threadlist c_sparethreads; /* Freed threads with stacks */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
+	 *
+	 * The run queue has one list per priority level; c_runqueue[0]
+	 * is the highest. See the scheduler notes in thread.c.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues */
+	unsigned c_runcount;		/* Threads queued; read unlocked */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -82,10 +100,14 @@ struct cpu {
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
 	 * and vaddr pair, or a paddr, or something else.
+	 *
+	 * If more requests arrive than fit, c_shootdown_full is set
+	 * and the whole TLB is flushed instead.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
+	bool c_shootdown_full;		/* Queue overflowed; flush it all */
 	struct spinlock c_ipi_lock;
 
 	/*
@@ -155,6 +177,11 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_many queues N shootdowns with a single IPI.
+ * ipi_tlbshootdown_wait waits until TARGET has processed all the
+ * shootdowns queued to it so far. It must be called with interrupts
+ * enabled and no spinlocks held, because the target may be sending
+ * shootdowns to us at the same time.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +196,9 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_many(struct cpu *target,
+			   const struct tlbshootdown *mappings, unsigned n);
+void ipi_tlbshootdown_wait(struct cpu *target);
 
 void interprocessor_interrupt(void);
 
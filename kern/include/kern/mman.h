@@ -0,0 +1,19 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap() and munmap().
+ */
+
+/* Protection (the PROT argument) */
+#define PROT_NONE       0x0      /* Page can't be accessed */
+#define PROT_READ       0x1      /* Page can be read */
+#define PROT_WRITE      0x2      /* Page can be written */
+#define PROT_EXEC       0x4      /* Page can be executed */
+
+/* Mapping type (the FLAGS argument); exactly one must be given */
+#define MAP_SHARED      0x1      /* Changes go to the file */
+#define MAP_PRIVATE     0x2      /* Changes are private (copy on write) */
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,37 @@
+#ifndef _KMALLOC_H_
+#define _KMALLOC_H_
+
+/*
+ * Per-cpu part of the kmalloc subpage allocator. (kmalloc and kfree
+ * themselves are declared in <lib.h>.)
+ *
+ * Each cpu keeps, for each of the KMALLOC_NSIZES subpage block sizes,
+ * two magazines of free blocks: the loaded one and the previous one.
+ * kmalloc and kfree use them with interrupts off but without taking
+ * any lock, and trade whole magazines with a shared depot when both
+ * run empty or full. See kmalloc.c.
+ *
+ *    kmalloc_cpucache_init - set up the magazines for a new cpu.
+ *                Called from cpu_create().
+ */
+
+#define KMALLOC_NSIZES	8	/* Subpage block sizes; see kmalloc.c */
+
+struct kmalloc_magazine;	/* Private to kmalloc.c */
+
+struct kmalloc_cpucache {
+	struct kmalloc_magazine *kc_loaded[KMALLOC_NSIZES];
+	struct kmalloc_magazine *kc_previous[KMALLOC_NSIZES];
+	unsigned kc_cpunum;		/* Owning cpu, for stats */
+	struct kmalloc_cpucache *kc_next; /* All caches, for stats */
+
+	/* Statistics */
+	unsigned kc_hits;		/* Allocs and frees served locally */
+	unsigned kc_exchanges;		/* Magazines traded with the depot */
+	unsigned kc_misses;		/* Allocs and frees done on the heap */
+};
+
+void kmalloc_cpucache_init(struct kmalloc_cpucache *kc, unsigned cpunum);
+
+
+#endif /* _KMALLOC_H_ */
@@ -0,0 +1,52 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches: allocators for many objects of one type.
+ *
+ * A cache carves whole pages (slabs) from alloc_kpages into objects of
+ * its size. When a slab is made, the constructor is run on each of
+ * its objects; objcache_free puts an object back without undoing
+ * that, so the next objcache_alloc gets it already constructed. The
+ * destructor runs only when a slab is given back to the page pool.
+ * So the constructor should set up what every object has the same
+ * way whenever it is free (locks, wait channels, list nodes), and
+ * objects must be returned in that state. Objects of one type also
+ * end up packed together on a few pages.
+ *
+ *    objcache_create - make a cache of objects of SIZE bytes, which
+ *                must leave room for at least one per page. CTOR
+ *                returns 0 or an error code, and may sleep; DTOR
+ *                must never sleep. Either may be NULL. NAME is not
+ *                copied. Returns NULL if out of memory.
+ *
+ *    objcache_destroy - destroy a cache, all of whose objects must
+ *                have been freed.
+ *
+ *    objcache_alloc - get a constructed object. Returns NULL if out
+ *                of memory (or a constructor failed). May sleep.
+ *
+ *    objcache_free - return an object to its cache.
+ *
+ *    objcache_reclaim - give back all slabs with no objects in use in
+ *                any cache. Returns the number of pages freed. Called
+ *                when memory runs out. Does not sleep.
+ *
+ *    objcache_printstats - print usage of each cache.
+ */
+
+#include <vm.h>
+
+struct objcache;
+
+struct objcache *objcache_create(const char *name, size_t size,
+				 int (*ctor)(void *obj),
+				 void (*dtor)(void *obj));
+void objcache_destroy(struct objcache *oc);
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+unsigned objcache_reclaim(void);
+void objcache_printstats(void);
+
+
+#endif /* _OBJCACHE_H_ */
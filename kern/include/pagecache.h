@@ -0,0 +1,76 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache: physical pages holding file contents, looked up by
+ * (vnode, offset). Offsets are page-aligned. The cache holds one
+ * coremap reference to each page, but no vnode references; a file
+ * system must call pagecache_purge when it reclaims a vnode.
+ * Private mappings share pages copy-on-write; shared mappings (and,
+ * for SFS, read() and write()) use the cached page itself, so all of
+ * them see the same data.
+ *
+ *    pagecache_getpage - return the page at OFFSET in V, with a
+ *                reference for the caller. If it isn't cached, get a
+ *                new page, call FILL to read PAGE_SIZE bytes at OFFSET
+ *                into it, zero whatever FILL didn't read (past EOF),
+ *                and cache it. FILL must read from the file itself,
+ *                not through the cache. This is the usual way to
+ *                implement VOP_MMAP.
+ *
+ *    pagecache_get - look up the page at OFFSET in V. If present, take
+ *                a reference to it for the caller (drop it with
+ *                coremap_free) and return it; otherwise return 0.
+ *
+ *    pagecache_add - enter the page PADDR, which the caller has just
+ *                filled from OFFSET in V, into the cache. The cache
+ *                takes its own reference; the caller keeps theirs. If
+ *                the page is already cached, or there is no memory for
+ *                the entry, nothing happens.
+ *
+ *    pagecache_invalidate - drop cached pages overlapping LEN bytes at
+ *                OFFSET in V. Call when the file is written other than
+ *                through the cached pages.
+ *
+ *    pagecache_markdirty - note that the page at OFFSET in V has been
+ *                (or is about to be) changed through a shared mapping
+ *                and must be written back.
+ *
+ *    pagecache_sync - write the dirty pages of V back with VOP_WRITE,
+ *                up to the current end of the file. Call after the
+ *                mappings that dirtied them are gone, or on fsync.
+ *                Pages still mapped are written but stay dirty.
+ *
+ *    pagecache_truncate - drop cached pages of V from LEN onward.
+ *                Call when the file is truncated.
+ *
+ *    pagecache_purge - drop all cached pages of V, dirty or not. Call
+ *                from VOP_RECLAIM once the vnode is sure to go away,
+ *                after writing back anything that needs it.
+ *
+ *    pagecache_reclaim - free up to MAX clean pages that nobody but the
+ *                cache is using. Returns the number freed. May sleep.
+ *
+ *    pagecache_printstats - print cache size and hit counts.
+ */
+
+#include <vm.h>
+
+struct vnode;
+struct uio;
+
+paddr_t pagecache_get(struct vnode *v, off_t offset);
+void pagecache_add(struct vnode *v, off_t offset, paddr_t paddr);
+int pagecache_getpage(struct vnode *v, off_t offset,
+		      int (*fill)(struct vnode *v, struct uio *uio),
+		      paddr_t *ret);
+void pagecache_invalidate(struct vnode *v, off_t offset, off_t len);
+void pagecache_markdirty(struct vnode *v, off_t offset);
+int pagecache_sync(struct vnode *v);
+void pagecache_truncate(struct vnode *v, off_t len);
+void pagecache_purge(struct vnode *v);
+unsigned pagecache_reclaim(unsigned max);
+void pagecache_printstats(void);
+
+
+#endif /* _PAGECACHE_H_ */
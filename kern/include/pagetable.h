@@ -0,0 +1,77 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table for user address spaces.
+ *
+ * A user virtual address is split 10/10/12: the top ten bits index
+ * the directory, the next ten index a second-level table of 1024
+ * page table entries, and the low twelve are the offset in the page.
+ * Since user space ends at USERSPACETOP, only the lower part of the
+ * directory is ever used. Second-level tables are one page each and
+ * are allocated only when something in their 4M span is touched.
+ *
+ *    pt_create - allocate an empty page table.
+ *
+ *    pt_destroy - free the page table and all second-level tables.
+ *                The caller must already have released whatever the
+ *                entries refer to.
+ *
+ *    pt_lookup - return a pointer to the entry for VADDR. If there is
+ *                no second-level table for VADDR, either allocate one
+ *                (if CREATE is true) or return NULL. Also returns NULL
+ *                if the allocation fails. Second-level tables are not
+ *                freed until pt_destroy, so the pointer stays good.
+ *
+ * An entry is zero (never touched), PTE_VALID (resident, in the frame
+ * given by PTE_FRAME), PTE_EVICTING (resident in PTE_FRAME but being
+ * paged out, and not to be used), or PTE_SWAPPED (paged out to the
+ * swap slot given by PTE_SLOT). Entries of an address space are
+ * protected by its as_ptlock, since the pageout code changes them
+ * from other threads.
+ *
+ * A resident page may be written only if neither PTE_COW nor
+ * PTE_RDONLY (the region isn't writable) is set; see PTE_WRITABLE.
+ *
+ * PTE_PREFETCH marks a resident page that vm_fault mapped ahead of
+ * use (fault-around); it's cleared when the page turns out to be
+ * used, for the statistics.
+ */
+
+#include <vm.h>
+
+typedef uint32_t pte_t;
+
+/* Fields in a page table entry */
+#define PTE_FRAME	0xfffff000	/* Physical page, if PTE_VALID */
+#define PTE_VALID	0x00000001	/* Page is resident */
+#define PTE_COW		0x00000002	/* Frame may be shared; copy on write */
+#define PTE_SWAPPED	0x00000004	/* Page is in swap slot PTE_SLOT */
+#define PTE_EVICTING	0x00000008	/* Page is being written to swap */
+#define PTE_PREFETCH	0x00000010	/* Mapped ahead, not yet seen used */
+#define PTE_RDONLY	0x00000020	/* In a region without write access */
+
+#define PTE_WRITABLE(pte) (((pte) & (PTE_COW | PTE_RDONLY)) == 0)
+
+#define PTE_SLOT(pte)	((pte) >> 12)
+#define PTE_MKSWAP(slot) (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+#define PT_L2_ENTRIES	1024
+#define PT_L1_SHIFT	22
+#define PT_L1_ENTRIES	(USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L1_INDEX(va)	((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va)	(((va) >> 12) & (PT_L2_ENTRIES - 1))
+
+/* Start of the 4M span covered by the next second-level table */
+#define PT_L2_NEXT(va)	((((va) >> PT_L1_SHIFT) + 1) << PT_L1_SHIFT)
+
+struct pagetable {
+	pte_t *pt_dir[PT_L1_ENTRIES];	/* Second-level tables, or NULL */
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+
+
+#endif /* _PAGETABLE_H_ */
@@ -0,0 +1,53 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * User pages are paged out to a raw disk device (SWAP_DEVICE) when
+ * physical memory runs out. The device is divided into page-sized
+ * slots, each with a reference count so that a paged-out page can
+ * stay shared copy-on-write after fork, just as a resident one can.
+ * A page table entry for a paged-out page holds its slot number (see
+ * pagetable.h).
+ *
+ *    swap_bootstrap - open the swap device. If it can't be opened the
+ *                system runs without swap.
+ *
+ *    swap_evict - page out a cluster of user pages chosen by the
+ *                coremap's clock and free their frames. Returns the
+ *                number of frames freed, which is 0 if there is no
+ *                swap, no swap space left, or nothing pageable. May
+ *                sleep; must not be called holding spinlocks.
+ *
+ *    swap_wait - wait until any pageout in progress has finished.
+ *                Used by the fault path when it finds a page being
+ *                paged out, and by as_destroy before freeing the page
+ *                table a pageout may still be looking at.
+ *
+ *    swap_in   - read the page in SLOT into the frame PADDR.
+ *
+ *    swap_share - add a reference to SLOT.
+ *
+ *    swap_free - drop a reference to SLOT; free it when none remain.
+ *
+ *    swap_printstats - print swap usage.
+ */
+
+#include <vm.h>
+
+#define SWAP_DEVICE	"lhd1raw:"
+
+/* Most pages written out with one disk request */
+#define SWAP_CLUSTER	16
+
+void swap_bootstrap(void);
+unsigned swap_evict(void);
+void swap_wait(void);
+int swap_in(unsigned slot, paddr_t paddr);
+void swap_share(unsigned slot);
+void swap_free(unsigned slot);
+void swap_printstats(void);
+
+
+#endif /* _SWAP_H_ */
@@ -53,6 +53,18 @@ struct semaphore {
 struct semaphore *sem_create(const char *name, unsigned initial_count);
 void sem_destroy(struct semaphore *);
 
+/*
+ * sem_init and sem_cleanup do the same for a semaphore embedded in
+ * some other structure. sem_init returns 0 or an error code.
+ *
+ * sem_reset sets the count of a semaphore nobody is waiting on back
+ * to COUNT, so it can be reused as if just made (e.g. before its
+ * containing object goes back to an object cache).
+ */
+int sem_init(struct semaphore *, const char *name, unsigned initial_count);
+void sem_cleanup(struct semaphore *);
+void sem_reset(struct semaphore *, unsigned count);
+
 /*
  * Operations (both atomic):
  *     P (proberen): decrement count. If the count is 0, block until
@@ -62,6 +74,12 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * P_timeout is P, but gives up after TICKS hardclocks (see timer.h).
+ * Returns 0 if the count was decremented, or ETIMEDOUT if not.
+ */
+int P_timeout(struct semaphore *, unsigned ticks);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -87,5 +87,15 @@ int sys__exit(int exitcode);
 int sys_waitpid(pid_t pid, int *status, int options, pid_t *retval);
 int sys_execv(char *program, char **args);
 
+/*
+ * Memory handling system calls
+ * (definition on syscall/mem_syscalls.c)
+*/
+
+int sys_sbrk(intptr_t amount, int *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+
 
 #endif /* _SYSCALL_H_ */
\ No newline at end of file
@@ -78,6 +78,8 @@ int semu19(int, char **);
 int semu20(int, char **);
 int semu21(int, char **);
 int semu22(int, char **);
+int semu23(int, char **);
+int semu24(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -93,6 +95,7 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmalloctest5(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
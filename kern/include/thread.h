@@ -72,6 +72,7 @@ struct thread {
 	 */
 	char *t_name;			/* Name of this thread */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
+	struct wchan *t_wchan;		/* Wait channel, while on its list */
 	threadstate_t t_state;		/* State this thread is in */
 
 	/*
@@ -85,6 +86,13 @@ struct thread {
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduler fields. See the notes in thread.c.
+	 */
+	unsigned t_priority;		/* Run queue level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_lastran;		/* t_cpu's c_hardclocks when last run */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -159,15 +167,16 @@ __DEAD void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Charge the current thread for a clock tick and preempt it if its
+ * time slice is used up or a higher-priority thread is waiting.
+ * Called from the timer interrupt.
  */
-void schedule(void);
+void thread_timeslice(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Reshuffle the run queue. Called from the timer interrupt.
  */
-void thread_consider_migration(void);
+void schedule(void);
 
 
 #endif /* _THREAD_H_ */
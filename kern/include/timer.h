@@ -0,0 +1,63 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+/*
+ * Kernel timers: call a function once a given number of hardclock
+ * ticks have gone by.
+ *
+ * Pending timers are kept on a hierarchical timing wheel advanced by
+ * hardclock() on cpu 0, so starting, cancelling and expiring a timer
+ * are all constant time however many are pending. See timer.c.
+ *
+ * The struct timer belongs to the caller (it's usually on the stack
+ * or embedded in something), and must stay put while pending.
+ *
+ *    timer_init - set up a timer to call FUNC(DATA) when it expires.
+ *
+ *    timer_start - arm the timer to expire on the TICKS'th hardclock
+ *                from now (so after between TICKS-1 and TICKS tick
+ *                periods; use timer_ticks to get a minimum delay). A
+ *                TICKS of 0 is taken as 1. The timer must not already
+ *                be pending.
+ *
+ *    timer_cancel - disarm the timer. Returns true if it was pending,
+ *                in which case FUNC will not be called. If FUNC is
+ *                running at the time, waits for it to finish first, so
+ *                after timer_cancel returns the timer can be freed. So
+ *                it must not be called from FUNC itself, or with any
+ *                spinlock that FUNC takes.
+ *
+ *    timer_now - return the number of ticks since boot. Wraps, so
+ *                compare values by subtracting.
+ *
+ *    timer_ticks - convert a duration to a number of ticks that will
+ *                wait at least that long with timer_start.
+ *
+ *    timer_hardclock - advance the wheel by one tick and call the
+ *                functions of timers that expire. Called from
+ *                hardclock() on one cpu.
+ *
+ * FUNC is called from the timer interrupt with no locks held. It must
+ * not sleep, but may take spinlocks, start or cancel other timers, and
+ * wake threads up.
+ */
+
+#include <kern/time.h>
+
+struct timer {
+	struct timer *tm_next;		/* Link on wheel slot */
+	struct timer **tm_pprev;	/* Back link; NULL if not pending */
+	unsigned tm_expire;		/* Tick to expire on */
+	void (*tm_func)(void *data);
+	void *tm_data;
+};
+
+void timer_init(struct timer *tm, void (*func)(void *data), void *data);
+void timer_start(struct timer *tm, unsigned ticks);
+bool timer_cancel(struct timer *tm);
+unsigned timer_now(void);
+unsigned timer_ticks(const struct timespec *ts);
+void timer_hardclock(void);
+
+
+#endif /* _TIMER_H_ */
@@ -57,6 +57,36 @@ void free_kpages(vaddr_t addr);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
+void vm_tlbshootdown_all(void);
+
+/*
+ * Background work for the idle loop, which calls this with interrupts
+ * off and no spinlocks held. Must not sleep. Returns true if it did
+ * something, in which case the caller should look for a runnable
+ * thread again before idling.
+ */
+bool vm_idle(void);
+
+/*
+ * Fault-around (real VM only, not dumbvm). When faults in a region
+ * go up through it in order, vm_fault maps up to the window's worth
+ * of following pages as well: those already resident, and for file
+ * regions, pages read ahead from the file.
+ *
+ *    vm_setfaultaround - set the window, in pages (at most
+ *                VM_FAULTAROUND_MAX). 0 turns fault-around off.
+ *
+ *    vm_getfaultaround - return the window.
+ *
+ *    vm_printstats - print fault-around statistics, including how
+ *                many of the pages mapped ahead were then used.
+ */
+#define VM_FAULTAROUND_DEFAULT	4
+#define VM_FAULTAROUND_MAX	16
+
+void vm_setfaultaround(unsigned npages);
+unsigned vm_getfaultaround(void);
+void vm_printstats(void);
 
 
 #endif /* _VM_H_ */
@@ -66,6 +66,14 @@ bool wchan_isempty(struct wchan *wc, struct spinlock *lk);
  */
 void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Like wchan_sleep, but give up after TICKS hardclocks (see timer.h)
+ * if nobody wakes the thread up first. Returns 0 if woken, or
+ * ETIMEDOUT.
+ */
+int wchan_sleep_timeout(struct wchan *wc, struct spinlock *lk,
+			unsigned ticks);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The associated spinlock should be locked.
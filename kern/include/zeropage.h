@@ -0,0 +1,51 @@
+#ifndef _ZEROPAGE_H_
+#define _ZEROPAGE_H_
+
+/*
+ * Zero-filled pages.
+ *
+ * Pages that start out zero (BSS, heap, stack) are read-mapped to
+ * one shared frame of zeros, copy-on-write, until they are first
+ * written; a page that is only ever read costs no memory. The zero
+ * frame has no reference count and is never freed, so callers that
+ * share or free frames must skip it.
+ *
+ * Frames for pages that are written are taken from a pool that the
+ * idle loop keeps topped up with pages it has already zeroed, which
+ * keeps the bzero off the fault path.
+ *
+ *    zeropage_bootstrap - allocate the zero frame. Call once from
+ *                vm_bootstrap(), after coremap_bootstrap().
+ *
+ *    zeropage_map - return the shared zero frame, for mapping.
+ *
+ *    zeropage_is - true if PADDR is the shared zero frame.
+ *
+ *    zeropage_alloc - return a private zeroed frame from the pool, or
+ *                0 if the pool is empty.
+ *
+ *    zeropage_refill - zero one free page and add it to the pool.
+ *                Returns false if the pool is full or there is no
+ *                free memory. Only takes spinlocks, so it can be run
+ *                from the idle loop.
+ *
+ *    zeropage_drain - give up to MAX pages in the pool back to the
+ *                coremap. Returns the number freed.
+ *
+ *    zeropage_printstats - print pool and zero frame usage.
+ */
+
+#include <vm.h>
+
+#define ZEROPAGE_POOLMAX	64	/* Most pre-zeroed pages kept */
+
+void zeropage_bootstrap(void);
+paddr_t zeropage_map(void);
+bool zeropage_is(paddr_t paddr);
+paddr_t zeropage_alloc(void);
+bool zeropage_refill(void);
+unsigned zeropage_drain(unsigned max);
+void zeropage_printstats(void);
+
+
+#endif /* _ZEROPAGE_H_ */
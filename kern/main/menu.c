@@ -43,6 +43,12 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <coremap.h>
+#include <pagecache.h>
+#include <swap.h>
+#include <zeropage.h>
+#include <objcache.h>
+#include "opt-dumbvm.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 
@@ -469,6 +475,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	objcache_printstats();
 
 	return 0;
 }
@@ -502,6 +509,50 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+	pagecache_printstats();
+#if !OPT_DUMBVM
+	swap_printstats();
+	zeropage_printstats();
+	vm_printstats();
+#endif
+	kprintf("TLB:\n");
+	mmu_printstats();
+
+	return 0;
+}
+
+#if !OPT_DUMBVM
+/*
+ * Command for setting the VM fault-around window.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Fault-around window: %u pages\n",
+			vm_getfaultaround());
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: fa [pages]\n");
+		return EINVAL;
+	}
+
+	vm_setfaultaround(atoi(args[1]));
+	kprintf("Fault-around window: %u pages\n", vm_getfaultaround());
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -568,6 +619,7 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kfree cost benchmark          ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -578,7 +630,7 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
-	"[semu1-22] Semaphore unit tests     ",
+	"[semu1-24] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
 	"[fs3] FS write stress               ",
@@ -609,6 +661,10 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vm] VM and TLB stats               ",
+#if !OPT_DUMBVM
+	"[fa] Set VM fault-around window     ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -660,6 +716,10 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vm",         cmd_vmstats },
+#if !OPT_DUMBVM
+	{ "fa",         cmd_faultaround },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -670,6 +730,7 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -706,6 +767,8 @@ static struct {
 	{ "semu20",	semu20 },
 	{ "semu21",	semu21 },
 	{ "semu22",	semu22 },
+	{ "semu23",	semu23 },
+	{ "semu24",	semu24 },
 
 	/* file system assignment tests */
 	{ "fs1",	fstest },
@@ -53,6 +53,7 @@
 #include <vfs.h>
 #include <kern/fcntl.h>
 #include <openfile.h>
+#include <objcache.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -65,6 +66,39 @@ struct proc *proctable[MAX_PROCESSES];
 /* Counter active processes*/
 int proc_counter;
 
+/* Cache of proc structures */
+static struct objcache *proc_cache;
+
+/*
+ * Object cache constructor and destructor for struct proc. The lock
+ * and the wait semaphore are set up once per cached proc, not on every
+ * proc_create.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+	int result;
+
+	result = sem_init(&proc->p_waitsem, "waitexit sem", 0);
+	if (result) {
+		return result;
+	}
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_cleanup(&proc->p_lock);
+	sem_cleanup(&proc->p_waitsem);
+}
+
 /*
  * Create a proc structure.
  */
@@ -74,20 +108,18 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 	pid_t pid = 0;
-	struct semaphore *sem;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = objcache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		objcache_free(proc_cache, proc);
 		return NULL;
 	}
 
 	proc->p_numthreads = 0;
-	spinlock_init(&proc->p_lock);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -120,8 +152,6 @@ proc_create(const char *name)
 	}
 
 	proc->is_exited = false;
-	sem = sem_create("waitexit sem",0);
-	proc->p_waitsem = *sem; 
 
 	return proc;
 }
@@ -224,10 +254,11 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_numthreads == 0);
-	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	/* Nobody may have collected the exit V; put it back as constructed. */
+	sem_reset(&proc->p_waitsem, 0);
+	objcache_free(proc_cache, proc);
 }
 
 /*
@@ -236,6 +267,12 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = objcache_create("proc", sizeof(struct proc),
+				     proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("objcache_create for procs failed\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
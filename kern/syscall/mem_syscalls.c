@@ -0,0 +1,112 @@
+#include <types.h>
+#include <kern/errno.h> // error codes
+#include <kern/fcntl.h> // O_ACCMODE, O_RDONLY, O_RDWR
+#include <kern/mman.h> // PROT_*, MAP_*
+#include <stat.h> // S_IFMT, S_IFREG
+#include <limits.h> // OPEN_MAX
+#include <current.h> // curproc
+#include <proc.h>
+#include <openfile.h> // openfile struct
+#include <vnode.h> // VOP_GETTYPE()
+#include <addrspace.h> // as_sbrk(), as_mmap(), as_munmap()
+#include <syscall.h>
+#include <lib.h>
+
+/*
+* Memory handling system calls
+*/
+
+int sys_sbrk(intptr_t amount, int *retval){
+
+    struct addrspace *as;
+    vaddr_t oldbreak;
+    int err;
+
+    as = proc_getas();
+    if(as == NULL){
+        return ENOMEM;
+    }
+
+    // Heap pages are only allocated when the process first touches them
+    err = as_sbrk(as, amount, &oldbreak);
+    if(err){
+        return err;
+    }
+
+    // sbrk returns the previous break
+    *retval = (int) oldbreak;
+
+    return 0;
+}
+
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int *retval){
+
+    struct addrspace *as;
+    struct openfile *of;
+    vaddr_t base;
+    mode_t type;
+    int err;
+
+    // The address is only a hint, and we don't use it
+    (void)addr;
+
+    // Exactly one of MAP_SHARED and MAP_PRIVATE
+    if(flags != MAP_SHARED && flags != MAP_PRIVATE){
+        return EINVAL;
+    }
+    if((prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0){
+        return EINVAL;
+    }
+
+    if(fd < 0 || fd >= OPEN_MAX || curproc->p_filetable[fd] == NULL){
+        return EBADF;
+    }
+    of = curproc->p_filetable[fd];
+
+    // The file must be readable, and writable too if the mapping writes to it
+    if((of->of_flags & O_ACCMODE) == O_WRONLY){
+        return EACCES;
+    }
+    if(flags == MAP_SHARED && (prot & PROT_WRITE) &&
+       (of->of_flags & O_ACCMODE) != O_RDWR){
+        return EACCES;
+    }
+
+    // Only regular files have pages to map; devices and directories don't
+    err = VOP_GETTYPE(of->of_vnode, &type);
+    if(err){
+        return err;
+    }
+    if((type & S_IFMT) != S_IFREG){
+        return ENODEV;
+    }
+
+    as = proc_getas();
+    if(as == NULL){
+        return ENOMEM;
+    }
+
+    // Nothing is read now; pages come in from the page cache when touched
+    err = as_mmap(as, of->of_vnode, offset, len, prot, flags == MAP_SHARED,
+                  &base);
+    if(err){
+        return err;
+    }
+
+    *retval = (int) base;
+
+    return 0;
+}
+
+int sys_munmap(userptr_t addr, size_t len){
+
+    struct addrspace *as;
+
+    as = proc_getas();
+    if(as == NULL){
+        return EINVAL;
+    }
+
+    return as_munmap(as, (vaddr_t) addr, len);
+}
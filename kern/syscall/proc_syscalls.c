@@ -55,6 +55,13 @@ int sys_fork(struct trapframe *tf, pid_t *retval){
     proctable[pid] = childproc;
     */
 
+    // 1. Current address space to the child one
+    // (copy-on-write, so this only walks the page table; it may
+    // sleep, so it must be done before taking p_lock)
+    err = as_copy(proc_getas(), &childproc->p_addrspace);
+    if(err)
+        return err;
+
     // Synchronization for current process struct variables
     spinlock_acquire(&curproc->p_lock);
 
@@ -63,11 +70,6 @@ int sys_fork(struct trapframe *tf, pid_t *retval){
     // Parent is the calling process (curproc)
     childproc->p_parentpid = curproc->p_pid;
 
-    // 1. Current address space to the child one
-    err = as_copy(curproc->p_addrspace, &childproc->p_addrspace);
-    if(err)
-        return err;
-
     // 2. File table
     for(int i=0;i<OPEN_MAX;i++) {
 		if(curproc->p_filetable[i] != NULL){
@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
 #include <vm.h> /* for PAGE_SIZE */
 #include <test.h>
 
@@ -378,3 +379,103 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Benchmark the cost of kfree as the kernel heap grows.
+ *
+ * Each round allocates KM5_NOBJS small objects, then grows the heap
+ * by allocating filler blocks (which stay allocated until the end)
+ * until the filler uses the round's number of pages, then times
+ * freeing the small objects. The objects' pages are older than the
+ * filler's, so a kfree that searched the heap pages would get slower
+ * every round. There are more objects than the per-cpu magazines
+ * hold, so most of the frees go all the way back to the heap pages.
+ *
+ * The page count doubles each round, up to the argument (default
+ * KM5_MAXPAGES).
+ */
+
+#define KM5_NOBJS	1024
+#define KM5_OBJSIZE	48
+#define KM5_FILLSIZE	1000	/* Four per page */
+#define KM5_MAXPAGES	512
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	struct timespec before, after, duration;
+	void **objs, **fill;
+	unsigned maxpages, npages, nfill, maxfill, i;
+	uint64_t ns;
+
+	if (nargs > 2) {
+		kprintf("kmalloctest5: usage: km5 [maxpages]\n");
+		return EINVAL;
+	}
+	maxpages = nargs == 2 ? (unsigned)atoi(args[1]) : KM5_MAXPAGES;
+	if (maxpages == 0) {
+		kprintf("kmalloctest5: usage: km5 [maxpages]\n");
+		return EINVAL;
+	}
+
+	maxfill = maxpages * (PAGE_SIZE / KM5_FILLSIZE);
+	objs = kmalloc(KM5_NOBJS * sizeof(objs[0]));
+	fill = kmalloc(maxfill * sizeof(fill[0]));
+	if (objs == NULL || fill == NULL) {
+		kfree(objs);
+		kfree(fill);
+		kprintf("kmalloctest5: out of memory\n");
+		return ENOMEM;
+	}
+
+	kprintf("kmalloctest5: %u objects of %u bytes per round\n",
+		KM5_NOBJS, KM5_OBJSIZE);
+
+	nfill = 0;
+	for (npages = 1; npages <= maxpages; npages *= 2) {
+		for (i=0; i<KM5_NOBJS; i++) {
+			objs[i] = kmalloc(KM5_OBJSIZE);
+			if (objs[i] == NULL) {
+				panic("kmalloctest5: out of memory on "
+				      "object %u\n", i);
+			}
+		}
+		while (nfill < npages * (PAGE_SIZE / KM5_FILLSIZE)) {
+			fill[nfill] = kmalloc(KM5_FILLSIZE);
+			if (fill[nfill] == NULL) {
+				kprintf("kmalloctest5: out of memory after "
+					"%u filler blocks\n", nfill);
+				break;
+			}
+			nfill++;
+		}
+
+		gettime(&before);
+		for (i=0; i<KM5_NOBJS; i++) {
+			kfree(objs[i]);
+		}
+		gettime(&after);
+
+		timespec_sub(&after, &before, &duration);
+		ns = duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+		kprintf("kmalloctest5: %4u filler pages: %llu ns per kfree\n",
+			nfill / (PAGE_SIZE / KM5_FILLSIZE),
+			(unsigned long long)(ns / KM5_NOBJS));
+
+		if (nfill < npages * (PAGE_SIZE / KM5_FILLSIZE)) {
+			break;
+		}
+	}
+
+	for (i=0; i<nfill; i++) {
+		kfree(fill[i]);
+	}
+	kfree(fill);
+	kfree(objs);
+
+	kprintf("kmalloctest5: done\n");
+	return 0;
+}
@@ -28,18 +28,21 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <wchan.h>
 #include <synch.h>
 #include <thread.h>
 #include <current.h>
 #include <clock.h>
+#include <timer.h>
 #include <test.h>
 
 /*
  * Unit tests for semaphores.
  *
- * We test 21 correctness criteria, each stated in a comment at the
+ * We test 23 correctness criteria, each stated in a comment at the
  * top of each test.
  *
  * Note that these tests go inside the semaphore abstraction to
@@ -818,3 +821,90 @@ semu22(int nargs, char **args)
 	panic("semu22: P tolerated null semaphore\n");
 	return 0;
 }
+
+/*
+ * 23. After calling P_timeout on a semaphore with count == 0 and
+ * nobody calling V:
+ *    - it returns ETIMEDOUT, after at least the given time
+ *    - sem_name is unchanged
+ *    - sem_wchan is unchanged and has no sleepers
+ *    - sem_lock is unheld and has no owner
+ *    - sem_count is still 0
+ */
+int
+semu23(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct wchan *wchan;
+	const char *name;
+	unsigned start;
+	int result;
+
+	(void)nargs; (void)args;
+
+	sem = makesem(0);
+
+	/* preconditions */
+	name = sem->sem_name;
+	KASSERT(!strcmp(name, NAMESTRING));
+	wchan = sem->sem_wchan;
+	KASSERT(spinlock_not_held(&sem->sem_lock));
+	KASSERT(sem->sem_count == 0);
+
+	start = timer_now();
+	result = P_timeout(sem, HZ / 10);
+
+	/* postconditions */
+	KASSERT(result == ETIMEDOUT);
+	KASSERT(timer_now() - start >= HZ / 10);
+	KASSERT(name == sem->sem_name);
+	KASSERT(!strcmp(name, NAMESTRING));
+	KASSERT(wchan == sem->sem_wchan);
+	KASSERT(spinlock_not_held(&sem->sem_lock));
+	KASSERT(sem->sem_count == 0);
+	spinlock_acquire(&sem->sem_lock);
+	KASSERT(wchan_isempty(sem->sem_wchan, &sem->sem_lock));
+	spinlock_release(&sem->sem_lock);
+
+	ok();
+	sem_destroy(sem);
+	return 0;
+}
+
+/*
+ * 24. After calling P_timeout on a semaphore with count == 0 and
+ * another thread uses V exactly once before the timeout:
+ *    - it returns 0
+ *    - sem_lock is unheld and has no owner
+ *    - sem_count is still 0
+ */
+int
+semu24(int nargs, char **args)
+{
+	struct semaphore *sem;
+	int result;
+
+	(void)nargs; (void)args;
+
+	sem = makesem(0);
+	/* semu19_sub waits a second, then does V */
+	result = thread_fork("semu24_sub", NULL, semu19_sub, sem, 0);
+	if (result) {
+		panic("semu24: whoops: thread_fork failed\n");
+	}
+
+	/* preconditions */
+	KASSERT(spinlock_not_held(&sem->sem_lock));
+	KASSERT(sem->sem_count == 0);
+
+	result = P_timeout(sem, 5 * HZ);
+
+	/* postconditions */
+	KASSERT(result == 0);
+	KASSERT(spinlock_not_held(&sem->sem_lock));
+	KASSERT(sem->sem_count == 0);
+
+	ok();
+	sem_destroy(sem);
+	return 0;
+}
@@ -33,12 +33,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <timer.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -54,23 +56,32 @@ sem_create(const char *name, unsigned initial_count)
                 return NULL;
         }
 
+	if (sem_init(sem, name, initial_count)) {
+		kfree(sem);
+		return NULL;
+	}
+
+        return sem;
+}
+
+int
+sem_init(struct semaphore *sem, const char *name, unsigned initial_count)
+{
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
-                return NULL;
+                return ENOMEM;
         }
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
+		return ENOMEM;
 	}
 
 	spinlock_init(&sem->sem_lock);
         sem->sem_count = initial_count;
 
-        return sem;
+        return 0;
 }
 
 void
@@ -78,11 +89,28 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
+	sem_cleanup(sem);
+        kfree(sem);
+}
+
+void
+sem_cleanup(struct semaphore *sem)
+{
 	/* wchan_cleanup will assert if anyone's waiting on it */
 	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
-        kfree(sem);
+}
+
+void
+sem_reset(struct semaphore *sem, unsigned count)
+{
+        KASSERT(sem != NULL);
+
+	spinlock_acquire(&sem->sem_lock);
+	KASSERT(wchan_isempty(sem->sem_wchan, &sem->sem_lock));
+	sem->sem_count = count;
+	spinlock_release(&sem->sem_lock);
 }
 
 void
@@ -120,6 +148,40 @@ P(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+int
+P_timeout(struct semaphore *sem, unsigned ticks)
+{
+	unsigned deadline, now;
+	int result;
+
+        KASSERT(sem != NULL);
+
+        /* May not block in an interrupt handler. */
+        KASSERT(curthread->t_in_interrupt == false);
+
+	result = 0;
+	deadline = timer_now() + ticks;
+
+	spinlock_acquire(&sem->sem_lock);
+        while (sem->sem_count == 0) {
+		/* Sleep for whatever's left after earlier wakeups. */
+		now = timer_now();
+		if ((int)(deadline - now) <= 0) {
+			result = ETIMEDOUT;
+			break;
+		}
+		wchan_sleep_timeout(sem->sem_wchan, &sem->sem_lock,
+				    deadline - now);
+        }
+	if (result == 0) {
+		KASSERT(sem->sem_count > 0);
+		sem->sem_count--;
+	}
+	spinlock_release(&sem->sem_lock);
+
+	return result;
+}
+
 void
 V(struct semaphore *sem)
 {
@@ -48,9 +48,12 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
 #include <kern/unistd.h>
+#include <objcache.h>
+#include <timer.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -70,6 +73,9 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Cache of thread structures. */
+static struct objcache *thread_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -109,40 +115,150 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Object cache constructor and destructor for struct thread. The
+ * list node is set up once per cached thread; thread_destroy checks
+ * that it comes back off every list.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+}
+
+/*
+ * Spare threads.
+ *
+ * When a thread that had its own stack is destroyed, the structure
+ * and the stack are kept together on the current cpu's list of spare
+ * threads, up to THREAD_MAXSPARE of them, instead of being freed. The
+ * next thread_fork on that cpu reuses the pair without going to the
+ * allocator at all. The stack guard band is left in place, so it only
+ * needs checking, not setting up again.
+ *
+ * The list is per-cpu and used only with interrupts off, so it needs
+ * no lock.
+ */
+#define THREAD_MAXSPARE	4
+
+/*
+ * Take a spare thread (with stack) from this cpu, or return NULL.
+ */
+static
+struct thread *
+thread_getspare(void)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_sparethreads);
+	splx(spl);
+
+	if (thread != NULL) {
+		thread_checkstack(thread);
+	}
+	return thread;
+}
+
+/*
+ * Give back the storage of a thread that's been cleaned up: keep it
+ * as a spare if it has a stack and there's room, otherwise free it.
+ */
+static
+void
+thread_release(struct thread *thread)
+{
+	bool kept;
+	int spl;
+
+	kept = false;
+	if (thread->t_stack != NULL) {
+		thread_checkstack(thread);
+		spl = splhigh();
+		if (curcpu->c_sparethreads.tl_count < THREAD_MAXSPARE) {
+			threadlist_addhead(&curcpu->c_sparethreads, thread);
+			kept = true;
+		}
+		splx(spl);
+	}
+	if (kept) {
+		return;
+	}
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+	objcache_free(thread_cache, thread);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * If WITHSTACK is true, the thread also gets a kernel stack, with
+ * its guard band set up; a spare thread is used if there is one.
+ * Otherwise t_stack is NULL and curcpu need not exist yet.
  */
 static
 struct thread *
-thread_create(const char *name)
+thread_create(const char *name, bool withstack)
 {
 	struct thread *thread;
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = withstack ? thread_getspare() : NULL;
 	if (thread == NULL) {
-		return NULL;
+		thread = objcache_alloc(thread_cache);
+		if (thread == NULL) {
+			return NULL;
+		}
+		thread->t_stack = NULL;
+		if (withstack) {
+			thread->t_stack = kmalloc(STACK_SIZE);
+			if (thread->t_stack == NULL) {
+				objcache_free(thread_cache, thread);
+				return NULL;
+			}
+			thread_checkstack_init(thread);
+		}
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		thread_release(thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
+	thread->t_wchan = NULL;
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
+	/* Scheduler fields: new threads start at the top level */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_lastran = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -166,6 +282,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -178,15 +295,20 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_sparethreads);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_full = false;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -194,8 +316,11 @@ cpu_create(unsigned hardware_number)
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
 
+	coremap_cpucache_init(&c->c_pagecache, c->c_number);
+	kmalloc_cpucache_init(&c->c_kmcache, c->c_number);
+
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
-	c->c_curthread = thread_create(namebuf);
+	c->c_curthread = thread_create(namebuf, false);
 	if (c->c_curthread == NULL) {
 		panic("cpu_create: thread_create failed\n");
 	}
@@ -275,17 +400,18 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
-	threadlistnode_cleanup(&thread->t_listnode);
+	/* The list node stays initialized for the next user; see thread_ctor. */
+	KASSERT(thread->t_listnode.tln_prev == NULL);
+	KASSERT(thread->t_listnode.tln_next == NULL);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+
+	/* Free or keep the structure and stack. */
+	thread_release(thread);
 }
 
 /*
@@ -315,6 +441,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *rq;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -329,9 +458,13 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		rq = &curcpu->c_runqueue[i];
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -372,6 +505,12 @@ thread_shutdown(void)
 void
 thread_bootstrap(void)
 {
+	thread_cache = objcache_create("thread", sizeof(struct thread),
+				       thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("objcache_create for threads failed\n");
+	}
+
 	cpuarray_init(&allcpus);
 
 	/*
@@ -443,6 +582,201 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. The caller holds C's runqueue lock.
+ *
+ * runqueue_add puts T at the end of the queue for its priority level.
+ * runqueue_remhead takes the first thread of the highest nonempty
+ * level, which is the one to run next. runqueue_remtail takes the last
+ * thread of the lowest nonempty level, which is the one that would
+ * run last, for stealing.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runcount++;
+}
+
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Work stealing.
+ *
+ * A cpu that runs out of threads takes one from the tail of the
+ * busiest other cpu's run queue: that is the lowest-priority thread
+ * there, the one that would otherwise wait longest. Busy cpus never
+ * push work away or look at anyone else's queue, and an idle cpu
+ * takes only the one runqueue lock of the cpu it steals from, so
+ * there's no sweep over all the runqueue locks.
+ *
+ * The busiest cpu is chosen by reading each c_runcount without its
+ * lock. The value may be stale by the time we act on it, but it's only
+ * a hint; the steal itself is done under the victim's lock, and if
+ * the queue has emptied in the meantime we just go idle and try again
+ * at the next interrupt.
+ *
+ * Migrating threads isn't free because of cache affinity; a thread's
+ * working cache set will end up having to be moved to the other CPU,
+ * which is fairly slow. Stealing only when otherwise idle keeps that
+ * to the cases where the alternative is a cpu doing nothing.
+ *
+ * Called from thread_switch with interrupts off and no runqueue lock
+ * held. Returns the stolen thread, now belonging to curcpu but on no
+ * run queue, or NULL.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	unsigned i, numcpus, load, maxload;
+	struct cpu *c, *victim;
+	struct thread *t;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	victim = NULL;
+	maxload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=1; i<numcpus; i++) {
+		/* Start with the next cpu, so thieves spread out. */
+		c = cpuarray_get(&allcpus, (curcpu->c_number + i) % numcpus);
+		load = c->c_runcount;
+		if (load > maxload) {
+			maxload = load;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_remtail(victim);
+	if (t != NULL && t == victim->c_curthread) {
+		/*
+		 * The victim's own curthread can be on its run queue
+		 * if it went to sleep, the victim went idle, and the
+		 * thread was woken before the victim got around to
+		 * switching back to it. It can't be moved (it's still
+		 * on the victim's stack in thread_switch), so put it
+		 * back where it was.
+		 */
+		runqueue_add(victim, t);
+		t = NULL;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t != NULL) {
+		t->t_cpu = curcpu->c_self;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	return t;
+}
+
+/*
+ * Wakeup placement.
+ *
+ * A thread waking up normally goes back to the cpu it last ran on
+ * (t_cpu), whose cache may still hold its working set. That stops
+ * being worth much once the cpu has run other things for a while, and
+ * isn't worth waiting for if some other cpu has nothing to do. So if
+ * the last cpu is busy and more than SCHED_CACHEWARM of its hardclocks
+ * have gone by since the thread ran there (t_lastran), send the thread
+ * to an idle cpu instead, if there is one. An idle curcpu (we're in an
+ * interrupt handler in its idle loop) is tried first.
+ *
+ * The idle flags are read without locks, as hints. But a thread may
+ * not be moved while it is still the old cpu's curthread: that is,
+ * while it went to sleep and the cpu went idle without switching away
+ * from its stack. That's checked under the old cpu's runqueue lock.
+ *
+ * Returns the cpu to queue TARGET on, and sets its t_cpu to match.
+ */
+#define SCHED_CACHEWARM	2	/* Hardclocks a cache stays warm */
+
+static
+struct cpu *
+thread_place(struct thread *target)
+{
+	struct cpu *last, *c;
+	unsigned i, numcpus;
+	bool movable;
+
+	last = target->t_cpu;
+	if (last->c_isidle ||
+	    last->c_hardclocks - target->t_lastran <= SCHED_CACHEWARM) {
+		return last;
+	}
+
+	c = curcpu->c_self;
+	if (c == last || !c->c_isidle) {
+		numcpus = cpuarray_num(&allcpus);
+		for (i=0; i<numcpus; i++) {
+			c = cpuarray_get(&allcpus, i);
+			if (c != last && c->c_isidle) {
+				break;
+			}
+		}
+		if (i == numcpus) {
+			return last;
+		}
+	}
+
+	spinlock_acquire(&last->c_runqueue_lock);
+	movable = last->c_curthread != target;
+	spinlock_release(&last->c_runqueue_lock);
+	if (!movable) {
+		return last;
+	}
+
+	target->t_cpu = c;
+	DEBUG(DB_THREADS, "Placed thread %s: cpu %u -> %u",
+	      target->t_name, last->c_number, c->c_number);
+	return c;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -454,8 +788,16 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 {
 	struct cpu *targetcpu;
 
-	/* Lock the run queue of the target thread's cpu. */
-	targetcpu = target->t_cpu;
+	/*
+	 * Lock the run queue of the target thread's cpu, choosing the
+	 * cpu first if the thread is waking up.
+	 */
+	if (!already_have_lock && target->t_state == S_SLEEP) {
+		targetcpu = thread_place(target);
+	}
+	else {
+		targetcpu = target->t_cpu;
+	}
 
 	if (already_have_lock) {
 		/* The target thread's cpu should be already locked. */
@@ -465,9 +807,21 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
+	/*
+	 * A thread waking up from wchan_sleep gave up the cpu before
+	 * its time slice ran out, so it moves up a level and starts a
+	 * fresh slice there.
+	 */
+	if (target->t_state == S_SLEEP) {
+		if (target->t_priority > 0) {
+			target->t_priority--;
+		}
+		target->t_ticks = 0;
+	}
+
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -501,19 +855,12 @@ thread_fork(const char *name,
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	/* Get a thread and stack, a cached pair if possible */
+	newthread = thread_create(name, true);
 	if (newthread == NULL) {
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
-	}
-	thread_checkstack_init(newthread);
-
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
@@ -585,11 +932,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/* Note when we last ran here, for wakeup placement. */
+	cur->t_lastran = curcpu->c_hardclocks;
+
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -613,6 +963,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		 * on the list.
 		 */
 		threadlist_addtail(&wc->wc_threads, cur);
+		cur->t_wchan = wc;
 		spinlock_release(lk);
 		break;
 	    case S_ZOMBIE:
@@ -642,10 +993,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/*
+			 * Take work from a busier cpu if possible;
+			 * failing that, do some VM housekeeping
+			 * (pre-zeroing) if any.
+			 */
+			next = thread_steal();
+			if (next == NULL && !vm_idle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -815,139 +1174,95 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each cpu has SCHED_NLEVELS
+ * run queues; a thread is queued at its t_priority level, and the
+ * highest nonempty level always runs first, round-robin within the
+ * level. A thread at level L gets a time slice of SCHED_QUANTUM(L)
+ * hardclocks. Using it up moves the thread down a level, so CPU-bound
+ * threads sink to long slices at low priority. Going to sleep before
+ * it's used up (waiting for I/O, or for another thread) moves the
+ * thread back up a level when it wakes (see thread_make_runnable), so
+ * interactive threads stay near the top and get the cpu soon after
+ * waking. A thread is also preempted at the next hardclock if a
+ * higher level has work.
+ *
+ * Ticks are counted across calls to thread_yield, so a thread can't
+ * keep its level by yielding just before its slice runs out.
  */
 
-void
-schedule(void)
-{
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
-}
+#define SCHED_QUANTUM(level)	(1U << (level))	/* Hardclocks per slice */
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Charge the current thread for one hardclock. Called from hardclock()
+ * on every tick.
  */
 void
-thread_consider_migration(void)
+thread_timeslice(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
-
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+	struct thread *cur;
+	unsigned i;
+	bool preempt;
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	/* If the timer interrupted the idle loop, nobody's running. */
+	if (curcpu->c_isidle) {
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+	cur = curthread;
+	preempt = false;
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		/* Slice used up; demote. */
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+		cur->t_ticks = 0;
+		preempt = true;
+	}
+	else {
+		for (i=0; i<cur->t_priority; i++) {
+			if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+				preempt = true;
+				break;
 			}
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	if (preempt) {
+		thread_yield();
 	}
+}
+
+/*
+ * This is called periodically from hardclock(). So that CPU-bound
+ * threads that have sunk to the bottom aren't starved by a steady
+ * stream of interactive ones, and so a thread that turns interactive
+ * after a long computation isn't stuck down there, move everything on
+ * this cpu back to the top level.
+ */
+void
+schedule(void)
+{
+	struct thread *t;
+	unsigned i;
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1013,6 +1328,70 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(lk);
 }
 
+/*
+ * Timed sleep. A timer is started before going to sleep; if it goes
+ * off while the thread is still on the channel's list, the callback
+ * takes it off and wakes it, just as wchan_wakeone would, and notes
+ * that it timed out. t_wchan tells whether the thread is still on the
+ * list; it's set and cleared under the channel's spinlock, which the
+ * callback also takes.
+ *
+ * The timer is cancelled (waiting for the callback, if it's running)
+ * before the spinlock is retaken, since the callback needs it.
+ */
+struct wchan_timeout {
+	struct thread *wt_thread;
+	struct wchan *wt_wchan;
+	struct spinlock *wt_lock;
+	bool wt_expired;
+};
+
+static
+void
+wchan_timeout_expire(void *data)
+{
+	struct wchan_timeout *wt = data;
+	struct thread *target = wt->wt_thread;
+
+	spinlock_acquire(wt->wt_lock);
+	if (target->t_wchan == wt->wt_wchan) {
+		threadlist_remove(&wt->wt_wchan->wc_threads, target);
+		target->t_wchan = NULL;
+		wt->wt_expired = true;
+		thread_make_runnable(target, false);
+	}
+	spinlock_release(wt->wt_lock);
+}
+
+int
+wchan_sleep_timeout(struct wchan *wc, struct spinlock *lk, unsigned ticks)
+{
+	struct wchan_timeout wt;
+	struct timer tm;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+
+	/* must hold the spinlock */
+	KASSERT(spinlock_do_i_hold(lk));
+
+	/* must not hold other spinlocks */
+	KASSERT(curcpu->c_spinlocks == 1);
+
+	wt.wt_thread = curthread;
+	wt.wt_wchan = wc;
+	wt.wt_lock = lk;
+	wt.wt_expired = false;
+	timer_init(&tm, wchan_timeout_expire, &wt);
+	timer_start(&tm, ticks);
+
+	thread_switch(S_SLEEP, wc, lk);
+
+	timer_cancel(&tm);
+	spinlock_acquire(lk);
+	return wt.wt_expired ? ETIMEDOUT : 0;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1030,6 +1409,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 		/* Nobody was sleeping. */
 		return;
 	}
+	target->t_wchan = NULL;
 
 	/*
 	 * Note that thread_make_runnable acquires a runqueue lock
@@ -1060,6 +1440,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * private list.
 	 */
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		target->t_wchan = NULL;
 		threadlist_addtail(&list, target);
 	}
 
@@ -1133,26 +1514,31 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	unsigned n;
+	ipi_tlbshootdown_many(target, mapping, 1);
+}
+
+/*
+ * Send a batch of TLB shootdowns to the specified CPU with one IPI.
+ * If they don't all fit in the queue, the target flushes its whole
+ * TLB instead, which covers everything queued.
+ */
+void
+ipi_tlbshootdown_many(struct cpu *target,
+		      const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned i;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+	if (target->c_numshootdown + n > TLBSHOOTDOWN_MAX) {
+		target->c_shootdown_full = true;
+		target->c_numshootdown = 0;
 	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	else if (!target->c_shootdown_full) {
+		for (i=0; i<n; i++) {
+			target->c_shootdown[target->c_numshootdown++] =
+				mappings[i];
+		}
 	}
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
@@ -1161,6 +1547,26 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Wait for the specified CPU to finish the TLB shootdowns queued to
+ * it. The pending bit is cleared only after the whole queue has been
+ * processed.
+ */
+void
+ipi_tlbshootdown_wait(struct cpu *target)
+{
+	bool done;
+
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	do {
+		spinlock_acquire(&target->c_ipi_lock);
+		done = (target->c_ipi_pending &
+			((uint32_t)1 << IPI_TLBSHOOTDOWN)) == 0;
+		spinlock_release(&target->c_ipi_lock);
+	} while (!done);
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -1202,10 +1608,16 @@ interprocessor_interrupt(void)
 		 * need to release the ipi lock while calling
 		 * vm_tlbshootdown.
 		 */
-		for (i=0; i<curcpu->c_numshootdown; i++) {
-			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		if (curcpu->c_shootdown_full) {
+			vm_tlbshootdown_all();
+		}
+		else {
+			for (i=0; i<curcpu->c_numshootdown; i++) {
+				vm_tlbshootdown(&curcpu->c_shootdown[i]);
+			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_full = false;
 	}
 
 	curcpu->c_ipi_pending = 0;
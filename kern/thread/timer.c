@@ -0,0 +1,226 @@
+/*
+ * Kernel timers. See timer.h.
+ *
+ * Pending timers sit on a hierarchical timing wheel: TIMER_LEVELS
+ * levels of TIMER_SLOTS slots each. Level 0 has a slot for each of
+ * the next TIMER_SLOTS ticks; each slot of level 1 covers TIMER_SLOTS
+ * ticks, each slot of level 2 covers TIMER_SLOTS level-1 spans, and
+ * so on. A timer goes in the lowest level whose span reaches its
+ * expiry time, in the slot for that time. Each tick, timer_hardclock
+ * runs the timers in the current level-0 slot. Each time level 0 comes
+ * round to slot 0 again, the next level-1 slot is emptied and its
+ * timers are put back in, which now sorts them into level 0; likewise
+ * level 2 into level 1 when level 1 comes round, and so on. So every
+ * operation is constant time, and a timer is moved at most once per
+ * level.
+ *
+ * Timers further off than the whole wheel covers are clamped to the
+ * end of it; at HZ=100 that's about 46 hours.
+ *
+ * Everything is protected by timer_lock. The callback of an expiring
+ * timer is called with the lock dropped; timer_running records which
+ * timer that is, so timer_cancel can wait for it.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <timer.h>
+
+#define TIMER_SLOTBITS	6
+#define TIMER_SLOTS	(1U << TIMER_SLOTBITS)	/* Slots per level */
+#define TIMER_LEVELS	4			/* Levels */
+#define TIMER_MAXTICKS	((1U << (TIMER_SLOTBITS * TIMER_LEVELS)) - 1)
+
+/* Slot in LEVEL for tick number T */
+#define TIMER_SLOT(t, level) \
+	(((t) >> (TIMER_SLOTBITS * (level))) & (TIMER_SLOTS - 1))
+
+static struct spinlock timer_lock = SPINLOCK_INITIALIZER;
+static struct timer *timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+static volatile unsigned timer_ticknum;	/* Ticks since boot */
+static struct timer *timer_running;	/* Callback in progress */
+
+/*
+ * Put TM on the wheel according to its expiry time.
+ */
+static
+void
+timer_insert(struct timer *tm)
+{
+	unsigned delta, level;
+	struct timer **slot;
+
+	KASSERT(spinlock_do_i_hold(&timer_lock));
+
+	delta = tm->tm_expire - timer_ticknum;
+	if (delta > TIMER_MAXTICKS) {
+		/* Too far off (or, if cascaded late, overdue). */
+		if ((int)delta < 0) {
+			delta = 0;
+		}
+		else {
+			delta = TIMER_MAXTICKS;
+		}
+		tm->tm_expire = timer_ticknum + delta;
+	}
+	for (level = 0; level < TIMER_LEVELS - 1; level++) {
+		if (delta < 1U << (TIMER_SLOTBITS * (level + 1))) {
+			break;
+		}
+	}
+
+	slot = &timer_wheel[level][TIMER_SLOT(tm->tm_expire, level)];
+	tm->tm_next = *slot;
+	if (*slot != NULL) {
+		(*slot)->tm_pprev = &tm->tm_next;
+	}
+	tm->tm_pprev = slot;
+	*slot = tm;
+}
+
+/*
+ * Take TM off the wheel.
+ */
+static
+void
+timer_remove(struct timer *tm)
+{
+	KASSERT(spinlock_do_i_hold(&timer_lock));
+	KASSERT(tm->tm_pprev != NULL);
+
+	*tm->tm_pprev = tm->tm_next;
+	if (tm->tm_next != NULL) {
+		tm->tm_next->tm_pprev = tm->tm_pprev;
+	}
+	tm->tm_next = NULL;
+	tm->tm_pprev = NULL;
+}
+
+/*
+ * Empty the current slot of LEVEL and sort its timers back in, which
+ * puts them all on lower levels. Returns the slot number.
+ */
+static
+unsigned
+timer_cascade(unsigned level)
+{
+	unsigned index;
+	struct timer *list, *tm;
+
+	index = TIMER_SLOT(timer_ticknum, level);
+	list = timer_wheel[level][index];
+	timer_wheel[level][index] = NULL;
+	while (list != NULL) {
+		tm = list;
+		list = tm->tm_next;
+		timer_insert(tm);
+	}
+	return index;
+}
+
+void
+timer_init(struct timer *tm, void (*func)(void *data), void *data)
+{
+	tm->tm_next = NULL;
+	tm->tm_pprev = NULL;
+	tm->tm_expire = 0;
+	tm->tm_func = func;
+	tm->tm_data = data;
+}
+
+void
+timer_start(struct timer *tm, unsigned ticks)
+{
+	KASSERT(tm->tm_func != NULL);
+
+	if (ticks == 0) {
+		ticks = 1;
+	}
+
+	spinlock_acquire(&timer_lock);
+	KASSERT(tm->tm_pprev == NULL);
+	tm->tm_expire = timer_ticknum + ticks;
+	timer_insert(tm);
+	spinlock_release(&timer_lock);
+}
+
+bool
+timer_cancel(struct timer *tm)
+{
+	bool pending;
+
+	spinlock_acquire(&timer_lock);
+	while (timer_running == tm) {
+		/* Let the callback finish. */
+		spinlock_release(&timer_lock);
+		spinlock_acquire(&timer_lock);
+	}
+	pending = tm->tm_pprev != NULL;
+	if (pending) {
+		timer_remove(tm);
+	}
+	spinlock_release(&timer_lock);
+
+	return pending;
+}
+
+unsigned
+timer_now(void)
+{
+	return timer_ticknum;
+}
+
+unsigned
+timer_ticks(const struct timespec *ts)
+{
+	unsigned ticks;
+
+	if (ts->tv_sec < 0 || (ts->tv_sec == 0 && ts->tv_nsec <= 0)) {
+		return 1;
+	}
+	if (ts->tv_sec >= TIMER_MAXTICKS / HZ) {
+		return TIMER_MAXTICKS;
+	}
+
+	/*
+	 * Round up to whole ticks, and add one more because the first
+	 * hardclock may come at any time after timer_start.
+	 */
+	ticks = (unsigned)ts->tv_sec * HZ;
+	if (ts->tv_nsec > 0) {
+		ticks += DIVROUNDUP((unsigned)ts->tv_nsec, 1000000000 / HZ);
+	}
+	return ticks + 1;
+}
+
+void
+timer_hardclock(void)
+{
+	unsigned index, level;
+	struct timer **slot, *tm;
+
+	spinlock_acquire(&timer_lock);
+	timer_ticknum++;
+
+	/* Bring timers down from higher levels as each one comes round. */
+	index = TIMER_SLOT(timer_ticknum, 0);
+	for (level = 1; index == 0 && level < TIMER_LEVELS; level++) {
+		index = timer_cascade(level);
+	}
+
+	slot = &timer_wheel[0][TIMER_SLOT(timer_ticknum, 0)];
+	while ((tm = *slot) != NULL) {
+		KASSERT(tm->tm_expire == timer_ticknum);
+		timer_remove(tm);
+		timer_running = tm;
+		spinlock_release(&timer_lock);
+
+		tm->tm_func(tm->tm_data);
+
+		spinlock_acquire(&timer_lock);
+		timer_running = NULL;
+	}
+	spinlock_release(&timer_lock);
+}
@@ -83,23 +83,29 @@ vopfail_uio_nosys(struct vnode *vn, struct uio *uio)
 // mmap
 
 int
-vopfail_mmap_isdir(struct vnode *vn /*add stuff */)
+vopfail_mmap_isdir(struct vnode *vn, off_t offset, paddr_t *ret)
 {
 	(void)vn;
+	(void)offset;
+	(void)ret;
 	return EISDIR;
 }
 
 int
-vopfail_mmap_perm(struct vnode *vn /*add stuff */)
+vopfail_mmap_perm(struct vnode *vn, off_t offset, paddr_t *ret)
 {
 	(void)vn;
+	(void)offset;
+	(void)ret;
 	return EPERM;
 }
 
 int
-vopfail_mmap_nosys(struct vnode *vn /*add stuff */)
+vopfail_mmap_nosys(struct vnode *vn, off_t offset, paddr_t *ret)
 {
 	(void)vn;
+	(void)offset;
+	(void)ret;
 	return ENOSYS;
 }
 
@@ -27,10 +27,19 @@
  * SUCH DAMAGE.
  */
 
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
+#include <kern/mman.h>
 #include <lib.h>
+#include <vnode.h>
 #include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <pagecache.h>
+#include <swap.h>
+#include <zeropage.h>
 #include <vm.h>
 #include <proc.h>
 
@@ -50,28 +59,246 @@ as_create(void)
 		return NULL;
 	}
 
-	/*
-	 * Initialize as needed.
-	 */
+	as->as_regions = NULL;
+	as->as_stack = NULL;
+	as->as_heap = NULL;
+	as->as_heapend = 0;
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	spinlock_init(&as->as_ptlock);
+	as->as_gen = mmu_newgen();
 
 	return as;
 }
 
+/*
+ * Add a region of NPAGES pages at VBASE (which must be page-aligned),
+ * with rg_flags FLAGS.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t vbase, size_t npages, int flags)
+{
+	struct region *rg;
+
+	KASSERT((vbase & PAGE_FRAME) == vbase);
+
+	if (vbase >= USERSPACETOP ||
+	    npages > (USERSPACETOP - vbase) / PAGE_SIZE) {
+		return EFAULT;
+	}
+
+	rg = kmalloc(sizeof(*rg));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_vbase = vbase;
+	rg->rg_npages = npages;
+	rg->rg_vnode = NULL;
+	rg->rg_fileoff = 0;
+	rg->rg_filestart = 0;
+	rg->rg_fileend = 0;
+	rg->rg_flags = flags;
+	rg->rg_lastfault = 0;
+	rg->rg_next = as->as_regions;
+	as->as_regions = rg;
+	return 0;
+}
+
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+struct region *
+as_growstack(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *stack, *rg;
+	vaddr_t base;
+
+	stack = as->as_stack;
+	base = vaddr & PAGE_FRAME;
+	if (stack == NULL || base >= stack->rg_vbase ||
+	    base < USERSTACK - USERSTACK_MAXPAGES * PAGE_SIZE) {
+		return NULL;
+	}
+
+	/* Don't grow into anything else. */
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg != stack &&
+		    rg->rg_vbase < stack->rg_vbase &&
+		    rg->rg_vbase + rg->rg_npages * PAGE_SIZE > base) {
+			return NULL;
+		}
+	}
+
+	stack->rg_npages += (stack->rg_vbase - base) / PAGE_SIZE;
+	stack->rg_vbase = base;
+	return stack;
+}
+
+/*
+ * Release the frames and swap slots of all pages in [START, END) and
+ * clear their page table entries. A page that is being paged out
+ * just loses our reference; the pageout notices and cleans up.
+ */
+static
+void
+as_freerange(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+	pte_t *pte, entry;
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL) {
+			/* No second-level table; skip its whole span. */
+			va = PT_L2_NEXT(va) - PAGE_SIZE;
+			continue;
+		}
+
+		spinlock_acquire(&as->as_ptlock);
+		entry = *pte;
+		*pte = 0;
+		spinlock_release(&as->as_ptlock);
+
+		if ((entry & (PTE_VALID | PTE_EVICTING)) &&
+		    !zeropage_is(entry & PTE_FRAME)) {
+			coremap_free(entry & PTE_FRAME);
+		}
+		else if (entry & PTE_SWAPPED) {
+			swap_free(PTE_SLOT(entry));
+		}
+	}
+}
+
+/*
+ * Invalidate every TLB entry for AS, which must be current: switch
+ * it to a new generation and shoot down the old one elsewhere.
+ */
+static
+void
+as_revoke(struct addrspace *as)
+{
+	uint32_t oldgen;
+
+	oldgen = as->as_gen;
+	as->as_gen = mmu_newgen();
+	mmu_activate(as->as_gen);
+	mmu_shootdown(oldgen, 0, USERSPACETOP / PAGE_SIZE);
+}
+
+/*
+ * Copy an address space for fork.
+ *
+ * No page contents are copied. Every resident page becomes shared
+ * copy-on-write between OLD and the new address space: both page
+ * table entries get PTE_COW and the frame gets an extra reference.
+ * vm_fault makes a private copy when either side next writes. The
+ * cost of fork is therefore proportional to the size of the page
+ * table, not to the amount of memory in use. Paged-out pages are
+ * shared the same way, by taking another reference to the slot.
+ *
+ * OLD must be the current address space (it is for fork), because
+ * its TLB entries may still allow writes. It gets a new TLB
+ * generation, which flushes them here and on any cpu that switches
+ * to it later; cpus running it right now get a shootdown.
+ */
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	struct region *rg;
+	vaddr_t va, top;
+	pte_t *oldpte, *newpte, entry;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
 
-	/*
-	 * Write this.
-	 */
+	for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		result = as_addregion(newas, rg->rg_vbase, rg->rg_npages,
+				      rg->rg_flags);
+		if (result) {
+			as_destroy(newas);
+			return result;
+		}
+		if (rg == old->as_stack) {
+			newas->as_stack = newas->as_regions;
+		}
+		if (rg == old->as_heap) {
+			newas->as_heap = newas->as_regions;
+			newas->as_heapend = old->as_heapend;
+		}
+		if (rg->rg_vnode != NULL) {
+			VOP_INCREF(rg->rg_vnode);
+			newas->as_regions->rg_vnode = rg->rg_vnode;
+			newas->as_regions->rg_fileoff = rg->rg_fileoff;
+			newas->as_regions->rg_filestart = rg->rg_filestart;
+			newas->as_regions->rg_fileend = rg->rg_fileend;
+		}
+
+		/* Share the pages that have been touched. */
+		top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		for (va = rg->rg_vbase; va < top; va += PAGE_SIZE) {
+			oldpte = pt_lookup(old->as_pt, va, false);
+			if (oldpte == NULL) {
+				va = PT_L2_NEXT(va) - PAGE_SIZE;
+				continue;
+			}
+			if (*oldpte == 0) {
+				continue;
+			}
+			newpte = pt_lookup(newas->as_pt, va, true);
+			if (newpte == NULL) {
+				as_revoke(old);
+				as_destroy(newas);
+				return ENOMEM;
+			}
 
-	(void)old;
+			spinlock_acquire(&old->as_ptlock);
+			while (*oldpte & PTE_EVICTING) {
+				spinlock_release(&old->as_ptlock);
+				swap_wait();
+				spinlock_acquire(&old->as_ptlock);
+			}
+			entry = *oldpte;
+			if ((entry & PTE_VALID) && (rg->rg_flags & RG_SHARED)) {
+				/* Shared mappings stay shared. */
+				coremap_share(entry & PTE_FRAME);
+			}
+			else if (entry & PTE_VALID) {
+				if (!zeropage_is(entry & PTE_FRAME)) {
+					coremap_share(entry & PTE_FRAME);
+				}
+				entry |= PTE_COW;
+				*oldpte = entry;
+			}
+			else {
+				KASSERT(entry & PTE_SWAPPED);
+				swap_share(PTE_SLOT(entry));
+			}
+			*newpte = entry & ~(pte_t)PTE_PREFETCH;
+			spinlock_release(&old->as_ptlock);
+		}
+	}
+
+	/* Writable TLB entries for now-shared pages must go. */
+	as_revoke(old);
 
 	*ret = newas;
 	return 0;
@@ -80,10 +307,28 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-	/*
-	 * Clean up as needed.
-	 */
+	struct region *rg;
+
+	while (as->as_regions != NULL) {
+		rg = as->as_regions;
+		as->as_regions = rg->rg_next;
+		as_freerange(as, rg->rg_vbase,
+			     rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+		if (rg->rg_flags & RG_SHARED) {
+			/* Nobody to report a failure to. */
+			(void)pagecache_sync(rg->rg_vnode);
+		}
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		kfree(rg);
+	}
+
+	/* A pageout may still be looking at our page table. */
+	swap_wait();
 
+	pt_destroy(as->as_pt);
+	spinlock_cleanup(&as->as_ptlock);
 	kfree(as);
 }
 
@@ -101,18 +346,18 @@ as_activate(void)
 		return;
 	}
 
-	/*
-	 * Write this.
-	 */
+	/* Flushes only if this cpu last ran some other address space. */
+	mmu_activate(as->as_gen);
 }
 
 void
 as_deactivate(void)
 {
 	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
+	 * Nothing to do: generation numbers are never reused, so
+	 * whatever this cpu still has loaded for a dead address
+	 * space can never match a live one and will be flushed at
+	 * the next as_activate.
 	 */
 }
 
@@ -122,61 +367,302 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. They
+ * are recorded in the region and enforced by vm_fault; in particular
+ * text is mapped read-only.
+ *
+ * No memory is allocated here; pages are filled in on first touch by
+ * vm_fault.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
+	size_t npages;
 
-	(void)as;
-	(void)vaddr;
-	(void)memsize;
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-	return ENOSYS;
+	/* Align the region. First, the base... */
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = memsize / PAGE_SIZE;
+
+	return as_addregion(as, vaddr, npages,
+			    (readable ? RG_READ : 0) |
+			    (writeable ? RG_WRITE : 0) |
+			    (executable ? RG_EXEC : 0));
 }
 
+/*
+ * Attach file backing to a region for load_elf. Nothing is read
+ * here; vm_fault reads each page the first time it is touched, and
+ * pages beyond FILESIZE (the BSS) are never read at all.
+ */
 int
-as_prepare_load(struct addrspace *as)
+as_define_file(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t memsize, size_t filesize)
 {
-	/*
-	 * Write this.
-	 */
+	struct region *rg;
+	struct stat st;
+	int result;
 
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+	if (filesize == 0) {
+		return 0;
+	}
+
+	rg = as_findregion(as, vaddr);
+	if (rg == NULL || rg->rg_vnode != NULL ||
+	    vaddr + filesize > rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+		return EFAULT;
+	}
+
+	/* Catch truncated files now rather than at fault time. */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset < 0 || offset + (off_t)filesize > st.st_size) {
+		kprintf("ELF: segment extends past end of file - "
+			"file truncated?\n");
+		return ENOEXEC;
+	}
+
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_fileoff = offset;
+	rg->rg_filestart = vaddr;
+	rg->rg_fileend = vaddr + filesize;
+
+	return 0;
+}
+
+/*
+ * Map part of a file for mmap. Like program segments, nothing is read
+ * here; vm_fault brings pages in as they are touched. Mappings are
+ * placed top-down from the bottom of the stack's reserved space,
+ * in the first gap big enough, so the heap can grow up toward them.
+ */
+int
+as_mmap(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+	int prot, bool shared, vaddr_t *ret)
+{
+	struct region *rg;
+	struct stat st;
+	vaddr_t base, top, floor;
+	size_t npages, filelen;
+	int result;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+
+	floor = ROUNDUP(as->as_heapend, PAGE_SIZE);
+	top = USERSTACK - USERSTACK_MAXPAGES * PAGE_SIZE;
+	for (;;) {
+		if (top < floor || top - floor < npages * PAGE_SIZE) {
+			return ENOMEM;
+		}
+		base = top - npages * PAGE_SIZE;
+		for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+			if (rg->rg_vbase < top &&
+			    rg->rg_vbase + rg->rg_npages * PAGE_SIZE > base) {
+				break;
+			}
+		}
+		if (rg == NULL) {
+			break;
+		}
+		/* Overlaps RG; try just below it. */
+		top = rg->rg_vbase;
+	}
+
+	result = as_addregion(as, base, npages,
+			      RG_MMAP | (shared ? RG_SHARED : 0) |
+			      ((prot & PROT_READ) ? RG_READ : 0) |
+			      ((prot & PROT_WRITE) ? RG_WRITE : 0) |
+			      ((prot & PROT_EXEC) ? RG_EXEC : 0));
+	if (result) {
+		return result;
+	}
+	rg = as->as_regions;
+
+	/* Past the end of the file the mapping reads as zero. */
+	filelen = 0;
+	if (offset < st.st_size) {
+		filelen = len;
+		if (st.st_size - offset < (off_t)len) {
+			filelen = st.st_size - offset;
+		}
+	}
+
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_fileoff = offset;
+	rg->rg_filestart = base;
+	rg->rg_fileend = base + filelen;
+
+	*ret = base;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg, **prg;
+
+	for (prg = &as->as_regions; *prg != NULL; prg = &(*prg)->rg_next) {
+		if ((*prg)->rg_vbase == vaddr) {
+			break;
+		}
+	}
+	rg = *prg;
+	if (rg == NULL || (rg->rg_flags & RG_MMAP) == 0 ||
+	    DIVROUNDUP(len, PAGE_SIZE) != rg->rg_npages) {
+		return EINVAL;
+	}
+	*prg = rg->rg_next;
+
+	as_freerange(as, rg->rg_vbase,
+		     rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+	mmu_shootdown(as->as_gen, rg->rg_vbase, rg->rg_npages);
+
+	/* Nothing can dirty the pages any more; write them back. */
+	if (rg->rg_flags & RG_SHARED) {
+		(void)pagecache_sync(rg->rg_vnode);
+	}
+	VOP_DECREF(rg->rg_vnode);
+	kfree(rg);
+
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Nothing to do; segments are paged in on demand. */
 	(void)as;
 	return 0;
 }
 
+/*
+ * Once the segments are in place, start the heap as an empty region
+ * at the first page above the highest of them.
+ */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
+	struct region *rg;
+	vaddr_t top, end;
+	int result;
 
-	(void)as;
+	top = 0;
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (end > top) {
+			top = end;
+		}
+	}
+
+	result = as_addregion(as, top, 0, RG_READ | RG_WRITE);
+	if (result) {
+		return result;
+	}
+	as->as_heap = as->as_regions;
+	as->as_heapend = top;
+	return 0;
+}
+
+/*
+ * Move the heap break by AMOUNT bytes and hand back the old break.
+ *
+ * Growing only extends the heap region; its pages are zero-filled by
+ * vm_fault when first touched, so memory that is allocated but never
+ * used costs nothing. Shrinking releases every page wholly above the
+ * new break at once, so the frames (or swap slots) go straight back
+ * to the allocator.
+ *
+ * The heap may not grow into the space reserved for the stack to
+ * grow into, nor into anything else above it.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct region *heap, *rg;
+	vaddr_t limit, newbreak, oldtop, newtop;
+
+	heap = as->as_heap;
+	if (heap == NULL) {
+		return ENOMEM;
+	}
+
+	limit = USERSTACK - USERSTACK_MAXPAGES * PAGE_SIZE;
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_vbase > heap->rg_vbase && rg->rg_vbase < limit) {
+			limit = rg->rg_vbase;
+		}
+	}
+
+	if (amount >= 0) {
+		if ((vaddr_t)amount > limit - as->as_heapend) {
+			return ENOMEM;
+		}
+	}
+	else {
+		if ((vaddr_t)-amount > as->as_heapend - heap->rg_vbase) {
+			return EINVAL;
+		}
+	}
+
+	newbreak = as->as_heapend + amount;
+	oldtop = heap->rg_vbase + heap->rg_npages * PAGE_SIZE;
+	newtop = ROUNDUP(newbreak, PAGE_SIZE);
+
+	if (newtop < oldtop) {
+		/*
+		 * No other thread can be using this address space while
+		 * we're in the system call, so dropping the TLB entries
+		 * after the frames are freed is safe.
+		 */
+		as_freerange(as, newtop, oldtop);
+		mmu_shootdown(as->as_gen, newtop, (oldtop - newtop) / PAGE_SIZE);
+	}
+	heap->rg_npages = (newtop - heap->rg_vbase) / PAGE_SIZE;
+
+	*oldbreak = as->as_heapend;
+	as->as_heapend = newbreak;
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+	int result;
 
-	(void)as;
+	/* The stack starts small and grows on demand; see as_growstack. */
+	result = as_addregion(as, USERSTACK - USERSTACK_INITPAGES * PAGE_SIZE,
+			      USERSTACK_INITPAGES, RG_READ | RG_WRITE);
+	if (result) {
+		return result;
+	}
+	as->as_stack = as->as_regions;
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
 
 	return 0;
 }
-
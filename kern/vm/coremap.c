@@ -0,0 +1,762 @@
+/*
+ * Physical page allocator.
+ *
+ * There is one struct coremap_entry per physical page frame, stored
+ * in an array carved out of the top of ram_stealmem() at bootstrap
+ * time. Frames below ram_getfirstfree() (the kernel image, the
+ * coremap itself, and anything allocated during early boot) are
+ * marked CME_FIXED and are never handed out or reclaimed.
+ *
+ * Allocations are runs of one or more contiguous frames. The length
+ * of the run is recorded in the entry for its first frame, so
+ * coremap_free only needs the starting address.
+ *
+ * Free frames are kept by a binary buddy allocator: free memory is
+ * made of blocks of 2^k frames, aligned to their size, with one free
+ * list per order k. The block heads are linked through cme_next and
+ * cme_prev and have cme_npages set to the block size. An allocation
+ * takes the smallest block big enough, splitting larger ones in half
+ * as needed, and gives back any frames past the run it wanted. A
+ * freed block is merged with its buddy (the other half of the block
+ * of twice the size) for as long as the buddy is also wholly free, so
+ * multi-page runs don't stay fragmented once they are released.
+ *
+ * Each allocation also carries a reference count (in the entry for
+ * its first frame). User pages shared copy-on-write after fork have
+ * one reference per address space mapping them; everything else
+ * stays at one.
+ *
+ * Single pages are normally served from, and freed into, the current
+ * cpu's struct coremap_cpucache. Frames sitting in a cpu cache are
+ * CME_CACHED: the global allocator treats them as in use, and the
+ * owning cpu may flip them between CME_CACHED and CME_USED without
+ * taking coremap_lock, since nobody else may touch them and either
+ * state looks the same to the buddy allocator. Only moving frames between
+ * the global pool and a cache (refill and drain) needs the lock.
+ *
+ * Frames holding a private user page also record which address space
+ * maps them, and where (coremap_setowner). Those are the only frames
+ * that can be paged out. coremap_pickvictims chooses them with a
+ * clock sweep: a frame whose reference byte is set (by vm_fault each
+ * time the page is loaded into a TLB) has the byte cleared and is
+ * passed over once. Since the MIPS TLB keeps no reference bits of its
+ * own, a page that stays in the TLB looks unreferenced; this is only
+ * an approximation of second chance. A picked frame is marked busy
+ * and gets an extra reference so it can't go away while the pageout
+ * is in progress, even if its owner frees it.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <coremap.h>
+
+/* Frame states */
+#define CME_FIXED	0	/* Not managed (kernel image, early boot) */
+#define CME_FREE	1	/* Available */
+#define CME_USED	2	/* Allocated */
+#define CME_CACHED	3	/* Free, but held by a cpu's page cache */
+
+/* Terminates a free list; frame 0 is always CME_FIXED */
+#define CM_NOFRAME	0
+
+struct coremap_entry {
+	uint8_t cme_state;		/* One of CME_* above */
+	uint8_t cme_busy;		/* Being paged out */
+	uint8_t cme_ref;		/* Referenced since the clock passed */
+	uint16_t cme_refcount;		/* References (first frame only) */
+	uint32_t cme_npages;		/* Run/block length (first frame only) */
+	uint32_t cme_next;		/* Free list links (free block heads) */
+	uint32_t cme_prev;
+	struct addrspace *cme_as;	/* Owning address space, if pageable */
+	vaddr_t cme_vaddr;		/* User address in CME_AS */
+};
+
+/*
+ * coremap_lock protects everything below, and also serializes calls
+ * to ram_stealmem() before the coremap exists.
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct coremap_entry *coremap;	/* NULL until bootstrap */
+static unsigned long cm_npages;		/* Total frames in the machine */
+static unsigned long cm_firstpage;	/* First frame we manage */
+static unsigned long cm_nfree;		/* Number of CME_FREE frames */
+static unsigned long cm_clock;		/* Clock hand for page replacement */
+
+/* Buddy free lists, by order, and their lengths */
+static uint32_t cm_freelist[COREMAP_MAXORDER + 1];
+static unsigned cm_nblocks[COREMAP_MAXORDER + 1];
+static struct coremap_cpucache *cm_caches; /* List of all cpu caches */
+
+/*
+ * Reset the bookkeeping for frame I as it changes hands.
+ */
+static
+void
+coremap_clearentry(unsigned long i)
+{
+	coremap[i].cme_busy = 0;
+	coremap[i].cme_ref = 0;
+	coremap[i].cme_as = NULL;
+	coremap[i].cme_vaddr = 0;
+}
+
+/*
+ * Put the free block of 2^ORDER frames starting at I on its free list.
+ */
+static
+void
+buddy_push(unsigned long i, unsigned order)
+{
+	uint32_t head;
+
+	head = cm_freelist[order];
+	coremap[i].cme_npages = 1UL << order;
+	coremap[i].cme_prev = CM_NOFRAME;
+	coremap[i].cme_next = head;
+	if (head != CM_NOFRAME) {
+		coremap[head].cme_prev = i;
+	}
+	cm_freelist[order] = i;
+	cm_nblocks[order]++;
+}
+
+/*
+ * Take the free block starting at I off the free list for ORDER.
+ */
+static
+void
+buddy_unlink(unsigned long i, unsigned order)
+{
+	uint32_t next, prev;
+
+	next = coremap[i].cme_next;
+	prev = coremap[i].cme_prev;
+	if (prev == CM_NOFRAME) {
+		KASSERT(cm_freelist[order] == i);
+		cm_freelist[order] = next;
+	}
+	else {
+		coremap[prev].cme_next = next;
+	}
+	if (next != CM_NOFRAME) {
+		coremap[next].cme_prev = prev;
+	}
+	coremap[i].cme_npages = 0;
+	cm_nblocks[order]--;
+}
+
+/*
+ * Allocate a block of 2^ORDER frames. Returns the index of its first
+ * frame, or 0 if there is no block that big. The caller sets the
+ * state of the frames.
+ */
+static
+unsigned long
+buddy_alloc(unsigned order)
+{
+	unsigned long i;
+	unsigned k;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (k=order; k<=COREMAP_MAXORDER; k++) {
+		if (cm_freelist[k] != CM_NOFRAME) {
+			break;
+		}
+	}
+	if (k > COREMAP_MAXORDER) {
+		return 0;
+	}
+
+	i = cm_freelist[k];
+	buddy_unlink(i, k);
+
+	/* Split it, putting the upper halves back. */
+	while (k > order) {
+		k--;
+		buddy_push(i + (1UL << k), k);
+	}
+	cm_nfree -= 1UL << order;
+	return i;
+}
+
+/*
+ * Free the block of 2^ORDER frames starting at I, merging it with its
+ * buddy for as long as possible. The frames must already be marked
+ * CME_FREE.
+ */
+static
+void
+buddy_free(unsigned long i, unsigned order)
+{
+	unsigned long size, buddy;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT((i & ((1UL << order) - 1)) == 0);
+
+	cm_nfree += 1UL << order;
+	while (order < COREMAP_MAXORDER) {
+		size = 1UL << order;
+		buddy = i ^ size;
+		if (buddy < cm_firstpage || buddy + size > cm_npages ||
+		    coremap[buddy].cme_state != CME_FREE ||
+		    coremap[buddy].cme_npages != size) {
+			break;
+		}
+		buddy_unlink(buddy, order);
+		i &= ~size;
+		order++;
+	}
+	buddy_push(i, order);
+}
+
+/*
+ * Free NPAGES frames starting at I, which need not be a power of two,
+ * as the largest aligned blocks that make them up. The frames must
+ * already be marked CME_FREE.
+ */
+static
+void
+buddy_freerange(unsigned long i, unsigned long npages)
+{
+	unsigned order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order < COREMAP_MAXORDER &&
+		       (i & (1UL << order)) == 0 &&
+		       (2UL << order) <= npages) {
+			order++;
+		}
+		buddy_free(i, order);
+		i += 1UL << order;
+		npages -= 1UL << order;
+	}
+}
+
+/*
+ * Smallest order of block that holds NPAGES frames.
+ */
+static
+unsigned
+buddy_order(unsigned long npages)
+{
+	unsigned order;
+
+	order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+/*
+ * Set up the page cache of a new cpu. This happens before
+ * coremap_bootstrap for the boot cpu, so it must not touch the
+ * coremap itself.
+ */
+void
+coremap_cpucache_init(struct coremap_cpucache *cc, unsigned cpunum)
+{
+	cc->cc_count = 0;
+	cc->cc_cpunum = cpunum;
+	cc->cc_hits = 0;
+	cc->cc_misses = 0;
+	cc->cc_refills = 0;
+	cc->cc_drains = 0;
+
+	spinlock_acquire(&coremap_lock);
+	cc->cc_next = cm_caches;
+	cm_caches = cc;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Take over physical memory from ram.c.
+ */
+void
+coremap_bootstrap(void)
+{
+	paddr_t cmpaddr, firstfree;
+	unsigned long i, cmpages;
+
+	spinlock_acquire(&coremap_lock);
+
+	KASSERT(coremap == NULL);
+
+	cm_npages = ram_getsize() / PAGE_SIZE;
+	cmpages = DIVROUNDUP(cm_npages * sizeof(struct coremap_entry),
+			     PAGE_SIZE);
+	cmpaddr = ram_stealmem(cmpages);
+	if (cmpaddr == 0) {
+		panic("coremap: cannot allocate %lu pages for coremap\n",
+		      cmpages);
+	}
+
+	/* No more ram_stealmem() after this. */
+	firstfree = ram_getfirstfree();
+	KASSERT(firstfree % PAGE_SIZE == 0);
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(cmpaddr);
+	cm_firstpage = firstfree / PAGE_SIZE;
+	KASSERT(cm_firstpage > 0 && cm_firstpage < cm_npages);
+
+	for (i=0; i<cm_firstpage; i++) {
+		coremap[i].cme_state = CME_FIXED;
+		coremap[i].cme_refcount = 1;
+		coremap[i].cme_npages = 1;
+		coremap_clearentry(i);
+	}
+	for (i=cm_firstpage; i<cm_npages; i++) {
+		coremap[i].cme_state = CME_FREE;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_npages = 0;
+		coremap_clearentry(i);
+	}
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		cm_freelist[i] = CM_NOFRAME;
+		cm_nblocks[i] = 0;
+	}
+	cm_nfree = 0;
+	buddy_freerange(cm_firstpage, cm_npages - cm_firstpage);
+	cm_clock = cm_firstpage;
+
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %lu pages managed, %lu reserved\n",
+		cm_nfree, cm_firstpage);
+}
+
+/*
+ * Move up to COREMAP_CPUCACHE_BATCH free frames from the global pool
+ * into the cache CC. Must be called on CC's own cpu with interrupts
+ * off.
+ */
+static
+void
+coremap_refill(struct coremap_cpucache *cc)
+{
+	unsigned long i;
+	unsigned n;
+
+	spinlock_acquire(&coremap_lock);
+	for (n=0; n < COREMAP_CPUCACHE_BATCH &&
+		     cc->cc_count < COREMAP_CPUCACHE_MAX; n++) {
+		i = buddy_alloc(0);
+		if (i == 0) {
+			break;
+		}
+		coremap[i].cme_state = CME_CACHED;
+		cc->cc_pages[cc->cc_count++] = (paddr_t)i * PAGE_SIZE;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (n > 0) {
+		cc->cc_refills++;
+	}
+}
+
+/*
+ * Return up to MAX frames from the cache CC to the global pool. The
+ * oldest (least recently freed, so least likely to still be in the
+ * processor cache) go first. Must be called on CC's
+ * own cpu with interrupts off.
+ */
+static
+void
+coremap_drain(struct coremap_cpucache *cc, unsigned max)
+{
+	unsigned long i;
+	unsigned n, j;
+
+	if (max > cc->cc_count) {
+		max = cc->cc_count;
+	}
+	if (max == 0) {
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	for (n=0; n<max; n++) {
+		i = cc->cc_pages[n] / PAGE_SIZE;
+		KASSERT(coremap[i].cme_state == CME_CACHED);
+		coremap[i].cme_state = CME_FREE;
+		buddy_free(i, 0);
+	}
+	spinlock_release(&coremap_lock);
+
+	for (j=0; n < cc->cc_count; j++, n++) {
+		cc->cc_pages[j] = cc->cc_pages[n];
+	}
+	cc->cc_count = j;
+	cc->cc_drains++;
+}
+
+/*
+ * Allocate one page from the current cpu's cache, refilling it if
+ * necessary. Returns 0 if none are available anywhere.
+ */
+static
+paddr_t
+coremap_alloc_cached(void)
+{
+	struct coremap_cpucache *cc;
+	paddr_t paddr;
+	unsigned long i;
+	int spl;
+
+	spl = splhigh();
+	cc = &curcpu->c_pagecache;
+	if (cc->cc_count > 0) {
+		cc->cc_hits++;
+	}
+	else {
+		cc->cc_misses++;
+		coremap_refill(cc);
+		if (cc->cc_count == 0) {
+			splx(spl);
+			return 0;
+		}
+	}
+	paddr = cc->cc_pages[--cc->cc_count];
+	splx(spl);
+
+	/* It's ours now; no lock needed (see above). */
+	i = paddr / PAGE_SIZE;
+	KASSERT(coremap[i].cme_state == CME_CACHED);
+	coremap[i].cme_npages = 1;
+	coremap[i].cme_refcount = 1;
+	coremap_clearentry(i);
+	coremap[i].cme_state = CME_USED;
+
+	return paddr;
+}
+
+/*
+ * Put a single free page into the current cpu's cache, draining a
+ * batch to the global pool first if the cache is full.
+ */
+static
+void
+coremap_free_cached(paddr_t paddr)
+{
+	struct coremap_cpucache *cc;
+	unsigned long i;
+	int spl;
+
+	i = paddr / PAGE_SIZE;
+	coremap[i].cme_npages = 0;
+	coremap[i].cme_refcount = 0;
+	coremap[i].cme_state = CME_CACHED;
+
+	spl = splhigh();
+	cc = &curcpu->c_pagecache;
+	if (cc->cc_count == COREMAP_CPUCACHE_MAX) {
+		coremap_drain(cc, COREMAP_CPUCACHE_BATCH);
+	}
+	cc->cc_pages[cc->cc_count++] = paddr;
+	splx(spl);
+}
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	unsigned long base, i, blocksize;
+	unsigned order;
+	paddr_t paddr;
+	int spl;
+
+	KASSERT(npages > 0);
+
+	if (coremap != NULL && npages == 1) {
+		return coremap_alloc_cached();
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	if (coremap == NULL) {
+		/* Too early; these pages can never be given back. */
+		paddr = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return paddr;
+	}
+
+	order = buddy_order(npages);
+	if (order > COREMAP_MAXORDER) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	base = buddy_alloc(order);
+	if (base == 0) {
+		/*
+		 * Pages held in our own cache might complete a block;
+		 * give them back and try once more. (Other cpus'
+		 * caches are left alone.)
+		 */
+		spinlock_release(&coremap_lock);
+		spl = splhigh();
+		coremap_drain(&curcpu->c_pagecache, COREMAP_CPUCACHE_MAX);
+		splx(spl);
+		spinlock_acquire(&coremap_lock);
+		base = buddy_alloc(order);
+	}
+	if (base == 0) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	for (i=base; i<base+npages; i++) {
+		KASSERT(coremap[i].cme_state == CME_FREE);
+		coremap[i].cme_state = CME_USED;
+		coremap[i].cme_npages = 0;
+		coremap_clearentry(i);
+	}
+	coremap[base].cme_npages = npages;
+	coremap[base].cme_refcount = 1;
+
+	/* Give back the rest of the block. */
+	blocksize = 1UL << order;
+	if (npages < blocksize) {
+		buddy_freerange(base + npages, blocksize - npages);
+	}
+
+	spinlock_release(&coremap_lock);
+
+	return (paddr_t)base * PAGE_SIZE;
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	unsigned long base, npages, i;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+
+	spinlock_acquire(&coremap_lock);
+
+	if (coremap == NULL) {
+		/* Came from ram_stealmem; leak it. */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	base = paddr / PAGE_SIZE;
+	KASSERT(base < cm_npages);
+
+	if (coremap[base].cme_state == CME_FIXED) {
+		/* Allocated before bootstrap; we don't own it. */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	npages = coremap[base].cme_npages;
+	if (coremap[base].cme_state != CME_USED || npages == 0) {
+		panic("coremap_free: 0x%x is not the start of a run\n",
+		      paddr);
+	}
+
+	/* Whoever owned it doesn't map it any more. */
+	coremap[base].cme_as = NULL;
+
+	KASSERT(coremap[base].cme_refcount > 0);
+	if (coremap[base].cme_refcount > 1) {
+		/* Still mapped elsewhere (or being paged out). */
+		coremap[base].cme_refcount--;
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	if (npages == 1) {
+		spinlock_release(&coremap_lock);
+		coremap_free_cached(paddr);
+		return;
+	}
+	KASSERT(base + npages <= cm_npages);
+
+	for (i=base; i<base+npages; i++) {
+		KASSERT(coremap[i].cme_state == CME_USED);
+		coremap[i].cme_state = CME_FREE;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_npages = 0;
+	}
+	buddy_freerange(base, npages);
+
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_share(paddr_t paddr)
+{
+	unsigned long i;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+	i = paddr / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap != NULL);
+	KASSERT(i >= cm_firstpage && i < cm_npages);
+	KASSERT(coremap[i].cme_state == CME_USED);
+	KASSERT(coremap[i].cme_npages == 1);
+	KASSERT(coremap[i].cme_refcount < 0xffff);
+	coremap[i].cme_refcount++;
+	/* Shared frames are not paged out. */
+	coremap[i].cme_as = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned long i;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+	KASSERT(as != NULL);
+	i = paddr / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(i >= cm_firstpage && i < cm_npages);
+	KASSERT(coremap[i].cme_state == CME_USED);
+	KASSERT(coremap[i].cme_npages == 1);
+	coremap[i].cme_as = as;
+	coremap[i].cme_vaddr = vaddr;
+	coremap[i].cme_ref = 1;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_touch(paddr_t paddr)
+{
+	/* A single byte store; no lock needed. */
+	coremap[paddr / PAGE_SIZE].cme_ref = 1;
+}
+
+unsigned
+coremap_pickvictims(struct coremap_victim *victims, unsigned max)
+{
+	struct coremap_entry *cme;
+	unsigned long span, n, i;
+	unsigned count;
+
+	count = 0;
+	spinlock_acquire(&coremap_lock);
+	if (coremap == NULL) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	/* Two full turns: the first may only clear reference bytes. */
+	span = cm_npages - cm_firstpage;
+	for (n=0; n < 2 * span && count < max; n++) {
+		i = cm_clock;
+		cme = &coremap[i];
+		cm_clock++;
+		if (cm_clock >= cm_npages) {
+			cm_clock = cm_firstpage;
+		}
+
+		if (cme->cme_state != CME_USED || cme->cme_as == NULL ||
+		    cme->cme_busy || cme->cme_refcount != 1) {
+			continue;
+		}
+		if (cme->cme_ref) {
+			cme->cme_ref = 0;
+			continue;
+		}
+		cme->cme_busy = 1;
+		cme->cme_refcount++;
+		victims[count].cv_paddr = (paddr_t)i * PAGE_SIZE;
+		victims[count].cv_as = cme->cme_as;
+		victims[count].cv_vaddr = cme->cme_vaddr;
+		count++;
+	}
+	spinlock_release(&coremap_lock);
+
+	return count;
+}
+
+void
+coremap_unpick(paddr_t paddr)
+{
+	unsigned long i;
+
+	i = paddr / PAGE_SIZE;
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[i].cme_busy);
+	coremap[i].cme_busy = 0;
+	spinlock_release(&coremap_lock);
+
+	coremap_free(paddr);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	unsigned long i;
+	unsigned count;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+	i = paddr / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap != NULL);
+	KASSERT(i < cm_npages);
+	count = coremap[i].cme_refcount;
+	spinlock_release(&coremap_lock);
+
+	return count;
+}
+
+/*
+ * Print page usage.
+ */
+void
+coremap_printstats(void)
+{
+	struct coremap_cpucache *cc;
+	unsigned long total, fixed, nfree, ncached, i;
+	unsigned nblocks[COREMAP_MAXORDER + 1];
+
+	spinlock_acquire(&coremap_lock);
+	if (coremap == NULL) {
+		spinlock_release(&coremap_lock);
+		kprintf("coremap: not initialized\n");
+		return;
+	}
+	total = cm_npages;
+	fixed = cm_firstpage;
+	nfree = cm_nfree;
+	ncached = 0;
+	for (i=cm_firstpage; i<cm_npages; i++) {
+		if (coremap[i].cme_state == CME_CACHED) {
+			ncached++;
+		}
+	}
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		nblocks[i] = cm_nblocks[i];
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %lu pages total, %lu reserved, %lu in use, "
+		"%lu free, %lu in cpu caches\n", total, fixed,
+		total - fixed - nfree - ncached, nfree, ncached);
+
+	kprintf("  free blocks of 1, 2, 4, ... pages:");
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		kprintf(" %u", nblocks[i]);
+	}
+	kprintf("\n");
+
+	/* The counters are only approximate while other cpus run. */
+	for (cc = cm_caches; cc != NULL; cc = cc->cc_next) {
+		kprintf("  cpu%u: %u cached, %u hits, %u misses, "
+			"%u refills, %u drains\n", cc->cc_cpunum,
+			cc->cc_count, cc->cc_hits, cc->cc_misses,
+			cc->cc_refills, cc->cc_drains);
+	}
+}
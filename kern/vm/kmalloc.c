@@ -29,7 +29,11 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <kmalloc.h>
 #include <vm.h>
 
 /*
@@ -78,6 +82,10 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    In front of the pages sits a per-cpu layer of magazines, which
+//    serves most allocations and frees without taking any shared
+//    lock. See "Per-cpu magazines" below.
+//
 
 ////////////////////////////////////////
 
@@ -125,7 +133,7 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
+#define NSIZES KMALLOC_NSIZES
 static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 
 #define SMALLEST_SUBPAGE_SIZE 16
@@ -145,7 +153,7 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref *prev_samesize;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -160,10 +168,8 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for all the heap pages. The per-cpu magazines and
+ * their depot (below) keep most kmalloc and kfree calls away from it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -339,11 +345,88 @@ freepageref(struct pageref *p)
 ////////////////////////////////////////
 
 /*
- * Each pageref is on two linked lists: one list of pages of blocks of
- * that same size, and one of all blocks.
+ * Each pageref is on a doubly linked list of pages of blocks of that
+ * same size, so it can be taken off in constant time.
  */
 static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+
+/*
+ * The pageref of each heap page, indexed by physical page number;
+ * NULL for pages that aren't subpage heap pages. An entry is set when
+ * a page joins the heap and cleared when it leaves, both under
+ * kmalloc_spinlock, and doesn't change while any block on the page is
+ * allocated. So kfree can find the page (and block size) of what it's
+ * been handed in constant time, and without the lock. As above, we
+ * take the 16M limit on RAM as its size.
+ */
+#define KHEAP_MAXPAGES ((16*1024*1024) / PAGE_SIZE)
+
+static struct pageref *kheap_pagerefs[KHEAP_MAXPAGES];
+
+/*
+ * Return the pageref of the heap page holding PTRADDR, or NULL if it
+ * is not on a heap page.
+ */
+static
+struct pageref *
+kheap_findpage(vaddr_t ptraddr)
+{
+	vaddr_t pagenum;
+
+	pagenum = KVADDR_TO_PADDR(ptraddr) / PAGE_SIZE;
+	if (pagenum >= KHEAP_MAXPAGES) {
+		return NULL;
+	}
+	return kheap_pagerefs[pagenum];
+}
+
+/*
+ * Record PR as the pageref of heap page PRPAGE, or PRPAGE as no
+ * longer a heap page if PR is NULL.
+ */
+static
+void
+kheap_setpage(vaddr_t prpage, struct pageref *pr)
+{
+	vaddr_t pagenum;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	pagenum = KVADDR_TO_PADDR(prpage) / PAGE_SIZE;
+	KASSERT(pagenum < KHEAP_MAXPAGES);
+	kheap_pagerefs[pagenum] = pr;
+}
+
+////////////////////////////////////////
+
+/*
+ * A magazine holds up to KMAG_ROUNDS free blocks of one size. The
+ * depot holds, per size, a list of full magazines, and also one list
+ * of empty magazines of no particular size. Magazines are carved out
+ * of whole pages, at most KMAG_MAXPAGES of them, and never freed.
+ */
+
+#define KMAG_ROUNDS 15
+#define KMAG_DEPOTMAX 8		/* Most full magazines per size in depot */
+#define KMAG_MAXPAGES 8
+
+struct kmalloc_magazine {
+	struct kmalloc_magazine *km_next;	/* On a depot list */
+	unsigned km_count;			/* Blocks in km_rounds */
+	void *km_rounds[KMAG_ROUNDS];
+};
+
+#define KMAG_PER_PAGE (PAGE_SIZE / sizeof(struct kmalloc_magazine))
+
+/*
+ * kmag_depotlock protects the depot and the list of cpu caches.
+ */
+static struct spinlock kmag_depotlock = SPINLOCK_INITIALIZER;
+static struct kmalloc_magazine *kmag_full[NSIZES];
+static unsigned kmag_nfull[NSIZES];
+static struct kmalloc_magazine *kmag_empty;
+static unsigned kmag_nempty;
+static unsigned kmag_npages;		/* Pages of magazines */
+static struct kmalloc_cpucache *kmag_caches;
 
 ////////////////////////////////////////
 
@@ -579,27 +662,23 @@ static
 void
 checksubpages(void)
 {
-	struct pageref *pr;
+	struct pageref *pr, *prev;
 	int i;
-	unsigned sc=0, ac=0;
+	unsigned sc=0;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (i=0; i<NSIZES; i++) {
+		prev = NULL;
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
+			KASSERT(pr->prev_samesize == prev);
+			KASSERT(kheap_findpage(PR_PAGEADDR(pr)) == pr);
 			KASSERT(sc < TOTAL_PAGEREFS);
 			sc++;
+			prev = pr;
 		}
 	}
-
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
-		ac++;
-	}
-
-	KASSERT(sc==ac);
 }
 #else
 #define checksubpages()
@@ -794,6 +873,34 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+/*
+ * Print the magazine layer's state. Blocks in magazines show up as
+ * allocated in the page maps. The per-cpu counts are only
+ * approximate while other cpus run.
+ */
+static
+void
+kmag_printstats(void)
+{
+	struct kmalloc_cpucache *kc;
+	unsigned i;
+
+	spinlock_acquire(&kmag_depotlock);
+	kprintf("Magazine depot: %u pages, %u empty magazines\n",
+		kmag_npages, kmag_nempty);
+	kprintf("   full magazines by size:");
+	for (i=0; i<NSIZES; i++) {
+		kprintf(" %u", kmag_nfull[i]);
+	}
+	kprintf("\n");
+	for (kc = kmag_caches; kc != NULL; kc = kc->kc_next) {
+		kprintf("   cpu%u: %u hits, %u exchanges, %u misses\n",
+			kc->kc_cpunum, kc->kc_hits, kc->kc_exchanges,
+			kc->kc_misses);
+	}
+	spinlock_release(&kmag_depotlock);
+}
+
 /*
  * Print the whole heap.
  */
@@ -801,46 +908,45 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	int i;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		subpage_stats(pr);
+	for (i=0; i<NSIZES; i++) {
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			subpage_stats(pr);
+		}
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmag_printstats();
 }
 
 ////////////////////////////////////////
 
 /*
- * Remove a pageref from both lists that it's on.
+ * Remove a pageref from the list that it's on.
  */
 static
 void
 remove_lists(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
-
 	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	if (pr->prev_samesize != NULL) {
+		pr->prev_samesize->next_samesize = pr->next_samesize;
 	}
-
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+	else {
+		KASSERT(sizebases[blktype] == pr);
+		sizebases[blktype] = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
 	}
 }
 
@@ -867,18 +973,13 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take a free block of type BLKTYPE off the heap pages, making a new
+ * page if there isn't one. Returns NULL if out of memory.
  */
 static
 void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+subpage_getblock(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
@@ -887,26 +988,6 @@ subpage_kmalloc(size_t sz
 
 	volatile int i;
 
-#ifdef GUARDS
-	size_t clientsz;
-#endif
-
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
-#endif
-
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -940,12 +1021,6 @@ subpage_kmalloc(size_t sz
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
 
 			checksubpages();
 
@@ -1007,107 +1082,45 @@ subpage_kmalloc(size_t sz
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
+	pr->prev_samesize = NULL;
 	pr->next_samesize = sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr;
+	}
 	sizebases[blktype] = pr;
 
-	pr->next_all = allbase;
-	allbase = pr;
+	kheap_setpage(prpage, pr);
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Put the free block at PTRADDR, of type BLKTYPE, back on its heap
+ * page, and release the page if that makes it entirely free.
  */
 static
-int
-subpage_kfree(void *ptr)
+void
+subpage_putblock(vaddr_t ptraddr, unsigned blktype)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
-#ifdef GUARDS
-	size_t blocksize, smallerblocksize;
-#endif
-
-	ptraddr = (vaddr_t)ptr;
-#ifdef GUARDS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/*
-		 * With guard bands, all client-facing subpage
-		 * pointers are offset by GUARD_PTROFFSET (which is 4)
-		 * from the underlying blocks and are therefore not
-		 * page-aligned. So a page-aligned pointer is not one
-		 * of ours. Catch this up front, as otherwise
-		 * subtracting GUARD_PTROFFSET could give a pointer on
-		 * a page we *do* own, and then we'll panic because
-		 * it's not a valid one.
-		 */
-		return -1;
-	}
-	ptraddr -= GUARD_PTROFFSET;
-#endif
-#ifdef LABELS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/* ditto */
-		return -1;
-	}
-	ptraddr -= LABEL_PTROFFSET;
-#endif
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
-	}
+	pr = kheap_findpage(ptraddr);
+	KASSERT(pr != NULL);
+	KASSERT(PR_BLOCKTYPE(pr) == blktype);
+	checksubpage(pr);
 
+	prpage = PR_PAGEADDR(pr);
 	offset = ptraddr - prpage;
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
-	}
-
-#ifdef GUARDS
-	blocksize = sizes[blktype];
-	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
-	checkguardband(ptraddr, smallerblocksize, blocksize);
-#endif
-
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef((void *)ptraddr, sizes[blktype]);
-
 	/*
 	 * We probably ought to check for free twice by seeing if the block
 	 * is already on the free list. But that's expensive, so we don't.
@@ -1141,6 +1154,7 @@ subpage_kfree(void *ptr)
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
+		kheap_setpage(prpage, NULL);
 		freepageref(pr);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
@@ -1155,7 +1169,452 @@ subpage_kfree(void *ptr)
 	checksubpages();
 	spinlock_release(&kmalloc_spinlock);
 #endif
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Each cpu has, for each block size, a loaded magazine and a
+//    previous magazine (see <kmalloc.h>). Allocation pops a block off
+//    the loaded magazine and free pushes one on, with interrupts off
+//    so nothing else can run on this cpu, and no lock. When the
+//    loaded magazine is empty (or full, for a free) it's swapped with
+//    the previous one. If that's no better, the cpu trades with the
+//    depot: on allocation it hands in its empty magazine for a full
+//    one, and on free it hands in a full one for an empty one. This
+//    moves KMAG_ROUNDS blocks at a time under kmag_depotlock. Only
+//    when the depot has nothing to trade does kmalloc or kfree go to
+//    the heap pages, one block at a time.
+//
+//    Blocks in magazines count as allocated as far as the heap pages
+//    are concerned, so a page isn't released while some of its blocks
+//    sit in magazines. To bound this, the depot keeps at most
+//    KMAG_DEPOTMAX full magazines of each size; blocks in any more
+//    than that go back to their pages.
+//
+//    Magazines hold bare blocks. Guard bands and labels are set up
+//    each time a block is handed out and checked when it's freed,
+//    whether or not a magazine is involved, and blocks in magazines
+//    are deadbeefed like those on the heap pages' freelists. Under
+//    SLOW the magazines are not used, because checksubpage takes any
+//    block not on its page's freelist to be in use.
+//
+
+#ifndef SLOW
+
+/*
+ * Get a magazine from a depot list.
+ */
+static
+struct kmalloc_magazine *
+kmag_get(struct kmalloc_magazine **list, unsigned *count)
+{
+	struct kmalloc_magazine *m;
 
+	spinlock_acquire(&kmag_depotlock);
+	m = *list;
+	if (m != NULL) {
+		*list = m->km_next;
+		(*count)--;
+	}
+	spinlock_release(&kmag_depotlock);
+	return m;
+}
+
+/*
+ * Put an empty magazine in the depot.
+ */
+static
+void
+kmag_putempty(struct kmalloc_magazine *m)
+{
+	KASSERT(m->km_count == 0);
+
+	spinlock_acquire(&kmag_depotlock);
+	m->km_next = kmag_empty;
+	kmag_empty = m;
+	kmag_nempty++;
+	spinlock_release(&kmag_depotlock);
+}
+
+/*
+ * Put a full magazine of type BLKTYPE in the depot, if there's room.
+ */
+static
+bool
+kmag_putfull(unsigned blktype, struct kmalloc_magazine *m)
+{
+	bool ok;
+
+	KASSERT(m->km_count == KMAG_ROUNDS);
+
+	spinlock_acquire(&kmag_depotlock);
+	ok = kmag_nfull[blktype] < KMAG_DEPOTMAX;
+	if (ok) {
+		m->km_next = kmag_full[blktype];
+		kmag_full[blktype] = m;
+		kmag_nfull[blktype]++;
+	}
+	spinlock_release(&kmag_depotlock);
+	return ok;
+}
+
+/*
+ * Return the blocks in magazine M, of type BLKTYPE, to the heap
+ * pages, and put the then empty magazine in the depot.
+ */
+static
+void
+kmag_drain(unsigned blktype, struct kmalloc_magazine *m)
+{
+	while (m->km_count > 0) {
+		subpage_putblock((vaddr_t)m->km_rounds[--m->km_count],
+				 blktype);
+	}
+	kmag_putempty(m);
+}
+
+/*
+ * Add a page of empty magazines to the depot, unless it has some
+ * already or we've made as many as we're going to.
+ */
+static
+void
+kmag_grow(void)
+{
+	struct kmalloc_magazine *m;
+	vaddr_t page;
+	unsigned i;
+
+	spinlock_acquire(&kmag_depotlock);
+	if (kmag_nempty > 0 || kmag_npages >= KMAG_MAXPAGES) {
+		spinlock_release(&kmag_depotlock);
+		return;
+	}
+	/* Claim the page now, so nobody else adds one too. */
+	kmag_npages++;
+	spinlock_release(&kmag_depotlock);
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		spinlock_acquire(&kmag_depotlock);
+		kmag_npages--;
+		spinlock_release(&kmag_depotlock);
+		return;
+	}
+
+	m = (struct kmalloc_magazine *)page;
+	for (i=0; i<KMAG_PER_PAGE; i++) {
+		m[i].km_count = 0;
+		kmag_putempty(&m[i]);
+	}
+}
+
+/*
+ * Pop a block off this cpu's magazines for BLKTYPE, swapping them if
+ * the loaded one is empty. Returns NULL if both are empty (or
+ * missing). Interrupts must be off.
+ */
+static
+void *
+kmag_pop(struct kmalloc_cpucache *kc, unsigned blktype)
+{
+	struct kmalloc_magazine *m, *prev;
+
+	m = kc->kc_loaded[blktype];
+	if (m == NULL || m->km_count == 0) {
+		prev = kc->kc_previous[blktype];
+		if (prev == NULL || prev->km_count == 0) {
+			return NULL;
+		}
+		kc->kc_previous[blktype] = m;
+		kc->kc_loaded[blktype] = prev;
+		m = prev;
+	}
+	return m->km_rounds[--m->km_count];
+}
+
+/*
+ * Push a block onto this cpu's magazines for BLKTYPE, swapping them
+ * if the loaded one is full. Returns false if both are full (or
+ * missing). Interrupts must be off.
+ */
+static
+bool
+kmag_push(struct kmalloc_cpucache *kc, unsigned blktype, void *block)
+{
+	struct kmalloc_magazine *m, *prev;
+
+	m = kc->kc_loaded[blktype];
+	if (m == NULL || m->km_count == KMAG_ROUNDS) {
+		prev = kc->kc_previous[blktype];
+		if (prev == NULL || prev->km_count == KMAG_ROUNDS) {
+			return false;
+		}
+		kc->kc_previous[blktype] = m;
+		kc->kc_loaded[blktype] = prev;
+		m = prev;
+	}
+	m->km_rounds[m->km_count++] = block;
+	return true;
+}
+
+/*
+ * Allocate a bare block of type BLKTYPE from the magazines. Returns
+ * NULL if neither this cpu nor the depot has one.
+ */
+static
+void *
+kmag_alloc(unsigned blktype)
+{
+	struct kmalloc_cpucache *kc;
+	struct kmalloc_magazine *full, *empty;
+	void *block;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* Too early in boot */
+		return NULL;
+	}
+
+	empty = NULL;
+	spl = splhigh();
+	kc = &curcpu->c_kmcache;
+	block = kmag_pop(kc, blktype);
+	if (block != NULL) {
+		kc->kc_hits++;
+	}
+	else {
+		/* Both are empty; trade one in for a full one. */
+		full = kmag_get(&kmag_full[blktype], &kmag_nfull[blktype]);
+		if (full != NULL) {
+			empty = kc->kc_previous[blktype];
+			kc->kc_previous[blktype] = kc->kc_loaded[blktype];
+			kc->kc_loaded[blktype] = full;
+			block = kmag_pop(kc, blktype);
+			KASSERT(block != NULL);
+			kc->kc_exchanges++;
+		}
+		else {
+			kc->kc_misses++;
+		}
+	}
+	splx(spl);
+
+	if (empty != NULL) {
+		kmag_putempty(empty);
+	}
+	return block;
+}
+
+/*
+ * Free the bare block BLOCK of type BLKTYPE into the magazines.
+ * Returns false if there was no room; the caller must then put it
+ * back on its page.
+ */
+static
+bool
+kmag_free(unsigned blktype, void *block)
+{
+	struct kmalloc_cpucache *kc;
+	struct kmalloc_magazine *full, *empty;
+	bool done;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+
+	full = NULL;
+	spl = splhigh();
+	kc = &curcpu->c_kmcache;
+	done = kmag_push(kc, blktype, block);
+	if (done) {
+		kc->kc_hits++;
+	}
+	else {
+		/* Both are full; trade one in for an empty one. */
+		empty = kmag_get(&kmag_empty, &kmag_nempty);
+		if (empty != NULL) {
+			full = kc->kc_previous[blktype];
+			kc->kc_previous[blktype] = kc->kc_loaded[blktype];
+			kc->kc_loaded[blktype] = empty;
+			done = kmag_push(kc, blktype, block);
+			KASSERT(done);
+			kc->kc_exchanges++;
+			if (full != NULL && kmag_putfull(blktype, full)) {
+				full = NULL;
+			}
+		}
+		else {
+			kc->kc_misses++;
+		}
+	}
+	splx(spl);
+
+	if (full != NULL) {
+		/* The depot has enough of these. */
+		kmag_drain(blktype, full);
+	}
+	return done;
+}
+
+#else /* SLOW */
+
+#define kmag_alloc(blktype) ((void)(blktype), (void *)NULL)
+#define kmag_free(blktype, block) ((void)(blktype), (void)(block), false)
+#define kmag_grow()
+
+#endif /* SLOW */
+
+void
+kmalloc_cpucache_init(struct kmalloc_cpucache *kc, unsigned cpunum)
+{
+	unsigned i;
+
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_loaded[i] = NULL;
+		kc->kc_previous[i] = NULL;
+	}
+	kc->kc_cpunum = cpunum;
+	kc->kc_hits = 0;
+	kc->kc_exchanges = 0;
+	kc->kc_misses = 0;
+
+	spinlock_acquire(&kmag_depotlock);
+	kc->kc_next = kmag_caches;
+	kmag_caches = kc;
+	spinlock_release(&kmag_depotlock);
+}
+
+////////////////////////////////////////
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	void *retptr;		// our result
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+	retptr = kmag_alloc(blktype);
+	if (retptr == NULL) {
+		retptr = subpage_getblock(blktype);
+		if (retptr == NULL) {
+			return NULL;
+		}
+		/* Make sure there are magazines for frees to fill. */
+		kmag_grow();
+	}
+
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+	return retptr;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t offset;		// offset into page
+#ifdef GUARDS
+	size_t blocksize, smallerblocksize;
+#endif
+
+	ptraddr = (vaddr_t)ptr;
+#ifdef GUARDS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/*
+		 * With guard bands, all client-facing subpage
+		 * pointers are offset by GUARD_PTROFFSET (which is 4)
+		 * from the underlying blocks and are therefore not
+		 * page-aligned. So a page-aligned pointer is not one
+		 * of ours. Catch this up front, as otherwise
+		 * subtracting GUARD_PTROFFSET could give a pointer on
+		 * a page we *do* own, and then we'll panic because
+		 * it's not a valid one.
+		 */
+		return -1;
+	}
+	ptraddr -= GUARD_PTROFFSET;
+#endif
+#ifdef LABELS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/* ditto */
+		return -1;
+	}
+	ptraddr -= LABEL_PTROFFSET;
+#endif
+
+	pr = kheap_findpage(ptraddr);
+	if (pr == NULL) {
+		/* Not on any of our pages - not a subpage allocation */
+		return -1;
+	}
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
+
+	offset = ptraddr - PR_PAGEADDR(pr);
+
+	/* Check for proper positioning and alignment */
+	if (offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+#ifdef GUARDS
+	blocksize = sizes[blktype];
+	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
+	checkguardband(ptraddr, smallerblocksize, blocksize);
+#endif
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+
+	if (!kmag_free(blktype, (void *)ptraddr)) {
+		subpage_putblock(ptraddr, blktype);
+	}
 	return 0;
 }
 
@@ -1187,7 +1646,11 @@ kmalloc(size_t sz)
 		unsigned long npages;
 		vaddr_t address;
 
-		/* Round up to a whole number of pages. */
+		/*
+		 * Round up to a whole number of pages. These come
+		 * from the coremap's buddy allocator, and are merged
+		 * back into larger free blocks by kfree.
+		 */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
 		if (address==0) {
@@ -0,0 +1,368 @@
+/*
+ * Object caches. See objcache.h.
+ *
+ * Each slab is one page: a struct objslab, then the objects. Every
+ * object is followed by a link word, which chains the free objects of
+ * the slab without overwriting their constructed state. A slab is on
+ * one of three lists of its cache, according to whether some, none or
+ * all of its objects are free. Allocation prefers partly used slabs,
+ * which keeps the objects in use on as few pages as possible. Up to
+ * OBJCACHE_KEEPEMPTY unused slabs are kept per cache; one that becomes
+ * unused beyond that is destroyed at once, and objcache_reclaim
+ * destroys the rest.
+ *
+ * Each cache has its own spinlock. Constructors and the page allocator
+ * may sleep, so they are called without it. Destructors must never
+ * sleep: objcache_free runs them from whatever context frees the
+ * object, and objcache_reclaim runs them with objcache_listlock held.
+ *
+ * Lock order: objcache_listlock, then oc_lock.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <objcache.h>
+
+#define OBJCACHE_ALIGN		8	/* Alignment of objects */
+#define OBJCACHE_KEEPEMPTY	1	/* Unused slabs kept per cache */
+
+struct objslab {
+	struct objcache *os_cache;	/* Cache this slab belongs to */
+	struct objslab **os_list;	/* Which of its lists it's on */
+	struct objslab *os_next;
+	struct objslab *os_prev;
+	void *os_free;			/* First free object */
+	unsigned os_nfree;		/* Number of free objects */
+};
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_size;			/* Object size */
+	size_t oc_linkoff;		/* Offset of the link word */
+	size_t oc_slotsize;		/* Object and link, aligned */
+	unsigned oc_perslab;		/* Objects per slab */
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+	struct objcache *oc_next;	/* All caches */
+
+	struct spinlock oc_lock;	/* Protects the rest */
+	struct objslab *oc_partial;	/* Slabs with some objects free */
+	struct objslab *oc_full;	/* Slabs with no objects free */
+	struct objslab *oc_empty;	/* Slabs with all objects free */
+	unsigned oc_nempty;		/* Slabs on oc_empty */
+	unsigned oc_nslabs;		/* Slabs in all */
+	unsigned oc_inuse;		/* Objects allocated */
+};
+
+#define SLAB_OBJOFFSET	ROUNDUP(sizeof(struct objslab), OBJCACHE_ALIGN)
+#define SLAB_OBJ(oc, slab, i) \
+	((char *)(slab) + SLAB_OBJOFFSET + (i) * (oc)->oc_slotsize)
+#define OBJ_LINK(oc, obj) (*(void **)((char *)(obj) + (oc)->oc_linkoff))
+
+/*
+ * objcache_listlock protects the list of all caches.
+ */
+static struct spinlock objcache_listlock = SPINLOCK_INITIALIZER;
+static struct objcache *objcache_all;
+
+/*
+ * Put SLAB on LIST.
+ */
+static
+void
+objslab_insert(struct objslab **list, struct objslab *slab)
+{
+	slab->os_list = list;
+	slab->os_prev = NULL;
+	slab->os_next = *list;
+	if (*list != NULL) {
+		(*list)->os_prev = slab;
+	}
+	*list = slab;
+}
+
+/*
+ * Take SLAB off whichever list it's on.
+ */
+static
+void
+objslab_remove(struct objslab *slab)
+{
+	if (slab->os_prev != NULL) {
+		slab->os_prev->os_next = slab->os_next;
+	}
+	else {
+		*slab->os_list = slab->os_next;
+	}
+	if (slab->os_next != NULL) {
+		slab->os_next->os_prev = slab->os_prev;
+	}
+	slab->os_list = NULL;
+}
+
+/*
+ * Move SLAB to the list its free count now calls for.
+ */
+static
+void
+objslab_sort(struct objcache *oc, struct objslab *slab)
+{
+	struct objslab **list;
+
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+
+	if (slab->os_nfree == 0) {
+		list = &oc->oc_full;
+	}
+	else if (slab->os_nfree == oc->oc_perslab) {
+		list = &oc->oc_empty;
+	}
+	else {
+		list = &oc->oc_partial;
+	}
+	if (slab->os_list != list) {
+		objslab_remove(slab);
+		objslab_insert(list, slab);
+	}
+}
+
+/*
+ * Make a new slab for OC and construct its objects.
+ */
+static
+struct objslab *
+objslab_create(struct objcache *oc)
+{
+	struct objslab *slab;
+	vaddr_t page;
+	unsigned i, j;
+	void *obj;
+	int result;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	slab = (struct objslab *)page;
+	slab->os_cache = oc;
+	slab->os_list = NULL;
+	slab->os_free = NULL;
+	slab->os_nfree = oc->oc_perslab;
+
+	/* Build the free list back to front, so it starts at object 0. */
+	for (i = oc->oc_perslab; i-- > 0; ) {
+		obj = SLAB_OBJ(oc, slab, i);
+		if (oc->oc_ctor != NULL) {
+			result = oc->oc_ctor(obj);
+			if (result) {
+				for (j = i + 1; j < oc->oc_perslab; j++) {
+					if (oc->oc_dtor != NULL) {
+						oc->oc_dtor(SLAB_OBJ(oc, slab,
+								     j));
+					}
+				}
+				free_kpages(page);
+				return NULL;
+			}
+		}
+		OBJ_LINK(oc, obj) = slab->os_free;
+		slab->os_free = obj;
+	}
+	return slab;
+}
+
+/*
+ * Destruct the objects of SLAB, none of which may be in use, and give
+ * back its page.
+ */
+static
+void
+objslab_destroy(struct objcache *oc, struct objslab *slab)
+{
+	unsigned i;
+
+	KASSERT(slab->os_nfree == oc->oc_perslab);
+
+	if (oc->oc_dtor != NULL) {
+		for (i=0; i<oc->oc_perslab; i++) {
+			oc->oc_dtor(SLAB_OBJ(oc, slab, i));
+		}
+	}
+	slab->os_cache = NULL;
+	free_kpages((vaddr_t)slab);
+}
+
+struct objcache *
+objcache_create(const char *name, size_t size,
+		int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct objcache *oc;
+
+	oc = kmalloc(sizeof(*oc));
+	if (oc == NULL) {
+		return NULL;
+	}
+	oc->oc_name = name;
+	oc->oc_size = size;
+	oc->oc_linkoff = ROUNDUP(size, sizeof(void *));
+	oc->oc_slotsize = ROUNDUP(oc->oc_linkoff + sizeof(void *),
+				  OBJCACHE_ALIGN);
+	oc->oc_perslab = (PAGE_SIZE - SLAB_OBJOFFSET) / oc->oc_slotsize;
+	KASSERT(oc->oc_perslab > 0);
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+
+	spinlock_init(&oc->oc_lock);
+	oc->oc_partial = NULL;
+	oc->oc_full = NULL;
+	oc->oc_empty = NULL;
+	oc->oc_nempty = 0;
+	oc->oc_nslabs = 0;
+	oc->oc_inuse = 0;
+
+	spinlock_acquire(&objcache_listlock);
+	oc->oc_next = objcache_all;
+	objcache_all = oc;
+	spinlock_release(&objcache_listlock);
+
+	return oc;
+}
+
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct objcache **p;
+	struct objslab *slab;
+
+	spinlock_acquire(&objcache_listlock);
+	for (p = &objcache_all; *p != oc; p = &(*p)->oc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = oc->oc_next;
+	spinlock_release(&objcache_listlock);
+
+	KASSERT(oc->oc_inuse == 0);
+	KASSERT(oc->oc_partial == NULL);
+	KASSERT(oc->oc_full == NULL);
+	while (oc->oc_empty != NULL) {
+		slab = oc->oc_empty;
+		objslab_remove(slab);
+		objslab_destroy(oc, slab);
+	}
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc);
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct objslab *slab;
+	void *obj;
+
+	spinlock_acquire(&oc->oc_lock);
+	slab = oc->oc_partial != NULL ? oc->oc_partial : oc->oc_empty;
+	if (slab == NULL) {
+		spinlock_release(&oc->oc_lock);
+		slab = objslab_create(oc);
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		objslab_insert(&oc->oc_empty, slab);
+		oc->oc_nempty++;
+		oc->oc_nslabs++;
+	}
+
+	KASSERT(slab->os_nfree > 0);
+	if (slab->os_nfree == oc->oc_perslab) {
+		oc->oc_nempty--;
+	}
+	obj = slab->os_free;
+	slab->os_free = OBJ_LINK(oc, obj);
+	slab->os_nfree--;
+	objslab_sort(oc, slab);
+	oc->oc_inuse++;
+	spinlock_release(&oc->oc_lock);
+
+	return obj;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct objslab *slab;
+	vaddr_t offset;
+
+	slab = (struct objslab *)((vaddr_t)obj & PAGE_FRAME);
+	offset = (vaddr_t)obj - (vaddr_t)slab;
+	KASSERT(slab->os_cache == oc);
+	KASSERT(offset >= SLAB_OBJOFFSET);
+	KASSERT((offset - SLAB_OBJOFFSET) % oc->oc_slotsize == 0);
+
+	spinlock_acquire(&oc->oc_lock);
+	KASSERT(slab->os_nfree < oc->oc_perslab);
+	OBJ_LINK(oc, obj) = slab->os_free;
+	slab->os_free = obj;
+	slab->os_nfree++;
+	oc->oc_inuse--;
+
+	if (slab->os_nfree == oc->oc_perslab) {
+		if (oc->oc_nempty >= OBJCACHE_KEEPEMPTY) {
+			/* Enough spare already. */
+			objslab_remove(slab);
+			oc->oc_nslabs--;
+			spinlock_release(&oc->oc_lock);
+			objslab_destroy(oc, slab);
+			return;
+		}
+		oc->oc_nempty++;
+	}
+	objslab_sort(oc, slab);
+	spinlock_release(&oc->oc_lock);
+}
+
+unsigned
+objcache_reclaim(void)
+{
+	struct objcache *oc;
+	struct objslab *list, *slab;
+	unsigned count;
+
+	count = 0;
+	spinlock_acquire(&objcache_listlock);
+	for (oc = objcache_all; oc != NULL; oc = oc->oc_next) {
+		spinlock_acquire(&oc->oc_lock);
+		list = oc->oc_empty;
+		oc->oc_empty = NULL;
+		oc->oc_nslabs -= oc->oc_nempty;
+		oc->oc_nempty = 0;
+		spinlock_release(&oc->oc_lock);
+
+		while (list != NULL) {
+			slab = list;
+			list = slab->os_next;
+			objslab_destroy(oc, slab);
+			count++;
+		}
+	}
+	spinlock_release(&objcache_listlock);
+
+	return count;
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+
+	spinlock_acquire(&objcache_listlock);
+	kprintf("objcache: %-12s %6s %6s %6s %6s\n", "cache", "size",
+		"/slab", "slabs", "inuse");
+	for (oc = objcache_all; oc != NULL; oc = oc->oc_next) {
+		kprintf("objcache: %-12s %6zu %6u %6u %6u\n", oc->oc_name,
+			oc->oc_size, oc->oc_perslab, oc->oc_nslabs,
+			oc->oc_inuse);
+	}
+	spinlock_release(&objcache_listlock);
+}
@@ -0,0 +1,425 @@
+/*
+ * Page cache. See pagecache.h.
+ *
+ * A fixed-size hash table of entries, chained, under one spinlock.
+ * Removed entries are collected on a local list and their pages freed
+ * after the lock is dropped.
+ *
+ * Entries don't hold vnode references, so cached pages never keep a
+ * closed file's vnode (or its filesystem) busy. Instead each file
+ * system's VOP_RECLAIM drops the vnode's pages with pagecache_purge
+ * before the vnode goes away.
+ *
+ * Dirty pages are only made by shared mappings, which write to the
+ * cached frame directly. They stay in the cache until pagecache_sync
+ * writes them back; pagecache_reclaim leaves them alone. Stores through
+ * a mapping aren't seen by the cache, so a page is only marked clean
+ * when it's written back while nothing but the cache refers to it;
+ * while any mapping remains it stays dirty and is written again on
+ * each sync.
+ *
+ * Lock order: pagecache_lock, then coremap_lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vnode.h>
+#include <coremap.h>
+#include <pagecache.h>
+
+#define PAGECACHE_BUCKETS	256
+#define PAGECACHE_SYNCBATCH	16	/* Dirty pages collected per pass */
+
+struct pcentry {
+	struct vnode *pe_vnode;
+	off_t pe_offset;
+	paddr_t pe_paddr;
+	bool pe_dirty;
+	unsigned pe_syncgen;		/* Last sync pass that collected it */
+	struct pcentry *pe_next;
+};
+
+static struct spinlock pagecache_lock = SPINLOCK_INITIALIZER;
+static struct pcentry *pagecache[PAGECACHE_BUCKETS];
+
+/* Statistics */
+static unsigned pc_npages;		/* Pages in the cache */
+static unsigned pc_hits;		/* Lookups that found a page */
+static unsigned pc_misses;		/* Lookups that didn't */
+
+static unsigned pc_syncgen;		/* Sync passes started */
+
+static
+unsigned
+pagecache_hash(struct vnode *v, off_t offset)
+{
+	uintptr_t h;
+
+	h = (uintptr_t)v >> 4;
+	h ^= (uintptr_t)(offset / PAGE_SIZE);
+	h ^= h >> 8;
+	return h % PAGECACHE_BUCKETS;
+}
+
+/*
+ * Find the entry for (V, OFFSET). Returns a pointer to the link that
+ * points at it, or to the terminating NULL link if there is none.
+ */
+static
+struct pcentry **
+pagecache_find(struct vnode *v, off_t offset)
+{
+	struct pcentry **pp;
+
+	KASSERT(spinlock_do_i_hold(&pagecache_lock));
+
+	pp = &pagecache[pagecache_hash(v, offset)];
+	while (*pp != NULL) {
+		if ((*pp)->pe_vnode == v && (*pp)->pe_offset == offset) {
+			break;
+		}
+		pp = &(*pp)->pe_next;
+	}
+	return pp;
+}
+
+/*
+ * Free entries removed from the table, now that the lock is dropped.
+ */
+static
+void
+pagecache_release(struct pcentry *list)
+{
+	struct pcentry *pe;
+
+	while (list != NULL) {
+		pe = list;
+		list = pe->pe_next;
+		coremap_free(pe->pe_paddr);
+		kfree(pe);
+	}
+}
+
+paddr_t
+pagecache_get(struct vnode *v, off_t offset)
+{
+	struct pcentry *pe;
+	paddr_t paddr = 0;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	spinlock_acquire(&pagecache_lock);
+	pe = *pagecache_find(v, offset);
+	if (pe != NULL) {
+		paddr = pe->pe_paddr;
+		coremap_share(paddr);
+		pc_hits++;
+	}
+	else {
+		pc_misses++;
+	}
+	spinlock_release(&pagecache_lock);
+
+	return paddr;
+}
+
+/*
+ * Enter PADDR into the cache as the page at OFFSET in V, unless some
+ * other page got there first. Returns the page that is now cached,
+ * which if it isn't PADDR has had a reference taken for the caller.
+ */
+static
+paddr_t
+pagecache_insert(struct vnode *v, off_t offset, paddr_t paddr)
+{
+	struct pcentry *pe, **pp;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	pe = kmalloc(sizeof(*pe));
+	if (pe == NULL) {
+		/* Not worth failing over; just don't cache it. */
+		return paddr;
+	}
+	pe->pe_vnode = v;
+	pe->pe_offset = offset;
+	pe->pe_paddr = paddr;
+	pe->pe_dirty = false;
+	pe->pe_syncgen = 0;
+
+	spinlock_acquire(&pagecache_lock);
+	pp = pagecache_find(v, offset);
+	if (*pp != NULL) {
+		/* Someone beat us to it. */
+		paddr = (*pp)->pe_paddr;
+		coremap_share(paddr);
+		spinlock_release(&pagecache_lock);
+		kfree(pe);
+		return paddr;
+	}
+	coremap_share(paddr);
+	pe->pe_next = NULL;
+	*pp = pe;
+	pc_npages++;
+	spinlock_release(&pagecache_lock);
+
+	return paddr;
+}
+
+void
+pagecache_add(struct vnode *v, off_t offset, paddr_t paddr)
+{
+	paddr_t cached;
+
+	cached = pagecache_insert(v, offset, paddr);
+	if (cached != paddr) {
+		coremap_free(cached);
+	}
+}
+
+int
+pagecache_getpage(struct vnode *v, off_t offset,
+		  int (*fill)(struct vnode *v, struct uio *uio), paddr_t *ret)
+{
+	struct iovec iov;
+	struct uio ku;
+	paddr_t paddr, cached;
+	vaddr_t kpage;
+	int result;
+
+	paddr = pagecache_get(v, offset);
+	if (paddr != 0) {
+		*ret = paddr;
+		return 0;
+	}
+
+	while ((kpage = alloc_kpages(1)) == 0) {
+		/* Make room by dropping some of our own clean pages. */
+		if (pagecache_reclaim(1) == 0) {
+			return ENOMEM;
+		}
+	}
+	paddr = KVADDR_TO_PADDR(kpage);
+
+	uio_kinit(&iov, &ku, (void *)kpage, PAGE_SIZE, offset, UIO_READ);
+	result = fill(v, &ku);
+	if (result) {
+		coremap_free(paddr);
+		return result;
+	}
+	bzero((char *)kpage + (PAGE_SIZE - ku.uio_resid), ku.uio_resid);
+
+	cached = pagecache_insert(v, offset, paddr);
+	if (cached != paddr) {
+		/* Lost a race; use the one already there. */
+		coremap_free(paddr);
+	}
+	*ret = cached;
+	return 0;
+}
+
+void
+pagecache_invalidate(struct vnode *v, off_t offset, off_t len)
+{
+	struct pcentry *pe, **pp, *dead = NULL;
+	off_t pos, end;
+
+	if (len <= 0) {
+		return;
+	}
+	end = offset + len;
+	pos = offset - offset % PAGE_SIZE;
+
+	spinlock_acquire(&pagecache_lock);
+	if (pc_npages == 0) {
+		spinlock_release(&pagecache_lock);
+		return;
+	}
+	for (; pos < end; pos += PAGE_SIZE) {
+		pp = pagecache_find(v, pos);
+		pe = *pp;
+		if (pe != NULL) {
+			*pp = pe->pe_next;
+			pe->pe_next = dead;
+			dead = pe;
+			pc_npages--;
+		}
+	}
+	spinlock_release(&pagecache_lock);
+
+	pagecache_release(dead);
+}
+
+void
+pagecache_markdirty(struct vnode *v, off_t offset)
+{
+	struct pcentry *pe;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	spinlock_acquire(&pagecache_lock);
+	pe = *pagecache_find(v, offset);
+	if (pe != NULL) {
+		pe->pe_dirty = true;
+	}
+	spinlock_release(&pagecache_lock);
+}
+
+/*
+ * Collect up to PAGECACHE_SYNCBATCH dirty pages of V not yet collected
+ * by sync pass GEN, and take a reference to each. A page that only
+ * the cache refers to is marked clean; one that's still mapped stays
+ * dirty, since it can be written again without faulting. Returns how
+ * many were found.
+ */
+static
+unsigned
+pagecache_collectdirty(struct vnode *v, unsigned gen,
+		       off_t *offsets, paddr_t *pages)
+{
+	struct pcentry *pe;
+	unsigned i, n = 0;
+
+	spinlock_acquire(&pagecache_lock);
+	for (i=0; i<PAGECACHE_BUCKETS && n < PAGECACHE_SYNCBATCH; i++) {
+		for (pe = pagecache[i]; pe != NULL; pe = pe->pe_next) {
+			if (pe->pe_vnode == v && pe->pe_dirty &&
+			    pe->pe_syncgen != gen) {
+				pe->pe_syncgen = gen;
+				if (coremap_refcount(pe->pe_paddr) == 1) {
+					pe->pe_dirty = false;
+				}
+				coremap_share(pe->pe_paddr);
+				offsets[n] = pe->pe_offset;
+				pages[n] = pe->pe_paddr;
+				if (++n == PAGECACHE_SYNCBATCH) {
+					break;
+				}
+			}
+		}
+	}
+	spinlock_release(&pagecache_lock);
+
+	return n;
+}
+
+int
+pagecache_sync(struct vnode *v)
+{
+	off_t offsets[PAGECACHE_SYNCBATCH];
+	paddr_t pages[PAGECACHE_SYNCBATCH];
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	unsigned i, n, gen;
+	size_t len;
+	int result, err = 0;
+
+	spinlock_acquire(&pagecache_lock);
+	gen = ++pc_syncgen;
+	spinlock_release(&pagecache_lock);
+
+	while ((n = pagecache_collectdirty(v, gen, offsets, pages)) > 0) {
+		result = VOP_STAT(v, &st);
+		if (result && err == 0) {
+			err = result;
+		}
+		for (i=0; i<n; i++) {
+			if (err == 0 && offsets[i] < st.st_size) {
+				/* Don't extend the file with the zero tail. */
+				len = PAGE_SIZE;
+				if (st.st_size - offsets[i] < PAGE_SIZE) {
+					len = st.st_size - offsets[i];
+				}
+				uio_kinit(&iov, &ku,
+					  (void *)PADDR_TO_KVADDR(pages[i]),
+					  len, offsets[i], UIO_WRITE);
+				result = VOP_WRITE(v, &ku);
+				if (result) {
+					/* Report it, but drop the rest. */
+					err = result;
+				}
+			}
+			coremap_free(pages[i]);
+		}
+	}
+	return err;
+}
+
+void
+pagecache_truncate(struct vnode *v, off_t len)
+{
+	struct pcentry *pe, **pp, *dead = NULL;
+	unsigned i;
+
+	spinlock_acquire(&pagecache_lock);
+	for (i=0; i<PAGECACHE_BUCKETS && pc_npages > 0; i++) {
+		pp = &pagecache[i];
+		while ((pe = *pp) != NULL) {
+			if (pe->pe_vnode == v &&
+			    pe->pe_offset + PAGE_SIZE > len) {
+				*pp = pe->pe_next;
+				pe->pe_next = dead;
+				dead = pe;
+				pc_npages--;
+			}
+			else {
+				pp = &pe->pe_next;
+			}
+		}
+	}
+	spinlock_release(&pagecache_lock);
+
+	pagecache_release(dead);
+}
+
+void
+pagecache_purge(struct vnode *v)
+{
+	pagecache_truncate(v, 0);
+}
+
+unsigned
+pagecache_reclaim(unsigned max)
+{
+	static unsigned hand;	/* Bucket to start from next time */
+	struct pcentry *pe, **pp, *dead = NULL;
+	unsigned i, n = 0;
+
+	spinlock_acquire(&pagecache_lock);
+	for (i=0; i<PAGECACHE_BUCKETS && n < max && pc_npages > 0; i++) {
+		pp = &pagecache[hand];
+		hand = (hand + 1) % PAGECACHE_BUCKETS;
+		while ((pe = *pp) != NULL && n < max) {
+			if (!pe->pe_dirty &&
+			    coremap_refcount(pe->pe_paddr) == 1) {
+				/* Only the cache has it, and it's clean. */
+				*pp = pe->pe_next;
+				pe->pe_next = dead;
+				dead = pe;
+				pc_npages--;
+				n++;
+			}
+			else {
+				pp = &pe->pe_next;
+			}
+		}
+	}
+	spinlock_release(&pagecache_lock);
+
+	pagecache_release(dead);
+	return n;
+}
+
+void
+pagecache_printstats(void)
+{
+	spinlock_acquire(&pagecache_lock);
+	kprintf("pagecache: %u pages, %u hits, %u misses\n",
+		pc_npages, pc_hits, pc_misses);
+	spinlock_release(&pagecache_lock);
+}
@@ -0,0 +1,406 @@
+/*
+ * Swap space and pageout. See swap.h.
+ *
+ * Pageout is done by whichever thread finds memory exhausted, one
+ * thread at a time. It takes a cluster of victims from the coremap's
+ * clock, unmaps them, and writes them to consecutive swap slots with
+ * a single disk request, so the disk sees one sequential write rather
+ * than a seek per page. Slots are handed out next-fit, so successive
+ * clusters also tend to follow one another on the disk.
+ *
+ * Each victim goes through these steps:
+ *
+ *   1. coremap_pickvictims marks the frame busy and takes a reference
+ *      on it.
+ *   2. Under the owner's as_ptlock, if the page table entry still
+ *      maps the frame privately, it is changed to PTE_EVICTING. From
+ *      then on a fault on the page waits (swap_wait) instead of using
+ *      the frame.
+ *   3. The page is shot down from every TLB, so nothing can write to
+ *      it any more, and then written out.
+ *   4. Under as_ptlock again, the entry becomes PTE_SWAPPED with the
+ *      slot number, and the owner's reference to the frame is dropped.
+ *      If the owner freed the page meanwhile (the entry is no longer
+ *      PTE_EVICTING), the slot is freed instead.
+ *   5. coremap_unpick drops the pageout's reference, freeing the frame.
+ *
+ * The owning address space can't be destroyed under us, because
+ * as_destroy calls swap_wait before freeing its page table.
+ *
+ * Lock order: as_ptlock, then swap_lock or coremap_lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <vm.h>
+
+/* Entry bits that don't affect pageout and carry through it */
+#define SWAP_KEEPBITS	(PTE_RDONLY | PTE_PREFETCH)
+
+/*
+ * swap_lock protects the slot map, the counters, and swap_pager.
+ */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct vnode *swap_vnode;	/* NULL if no swap */
+static uint16_t *swap_refs;		/* Reference count per slot */
+static unsigned swap_nslots;		/* Size of swap in pages */
+static unsigned swap_nfree;		/* Free slots */
+static unsigned swap_hint;		/* Where the next search starts */
+
+/* Thread currently paging out, and where others wait for it */
+static struct thread *swap_pager;
+static struct wchan *swap_wchan;
+
+/* Statistics */
+static unsigned swap_pageouts;		/* Pages written */
+static unsigned swap_clusters;		/* Write requests */
+static unsigned swap_pageins;		/* Pages read */
+
+void
+swap_bootstrap(void)
+{
+	char path[sizeof(SWAP_DEVICE)];
+	struct stat st;
+	unsigned i;
+	int result;
+
+	swap_wchan = wchan_create("swap");
+	if (swap_wchan == NULL) {
+		panic("swap: wchan_create failed\n");
+	}
+
+	/* vfs_open may modify its argument */
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: %s: stat: %s\n", SWAP_DEVICE, strerror(result));
+	}
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots == 0) {
+		kprintf("swap: %s is too small; running without swap\n",
+			SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_refs = kmalloc(swap_nslots * sizeof(swap_refs[0]));
+	if (swap_refs == NULL) {
+		panic("swap: cannot allocate slot map\n");
+	}
+	for (i=0; i<swap_nslots; i++) {
+		swap_refs[i] = 0;
+	}
+	swap_nfree = swap_nslots;
+	swap_hint = 0;
+
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+/*
+ * Allocate up to WANT consecutive free slots. Returns the number
+ * obtained (0 if swap is full) and the first one in *SLOT. The run
+ * starts at the first free slot at or after the hint.
+ */
+static
+unsigned
+swap_alloc(unsigned want, unsigned *slot)
+{
+	unsigned n, i, start, len;
+
+	spinlock_acquire(&swap_lock);
+	if (swap_nfree == 0) {
+		spinlock_release(&swap_lock);
+		return 0;
+	}
+	start = swap_hint;
+	for (n=0; n<swap_nslots; n++) {
+		if (swap_refs[start] == 0) {
+			break;
+		}
+		start = (start + 1) % swap_nslots;
+	}
+	KASSERT(swap_refs[start] == 0);
+
+	len = 0;
+	for (i = start; i < swap_nslots && len < want; i++) {
+		if (swap_refs[i] != 0) {
+			break;
+		}
+		swap_refs[i] = 1;
+		len++;
+	}
+	swap_nfree -= len;
+	swap_hint = (start + len) % swap_nslots;
+	spinlock_release(&swap_lock);
+
+	*slot = start;
+	return len;
+}
+
+void
+swap_share(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(swap_refs[slot] > 0 && swap_refs[slot] < 0xffff);
+	swap_refs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]--;
+	if (swap_refs[slot] == 0) {
+		swap_nfree++;
+	}
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Transfer N pages, described by IOV, to or from the slots starting
+ * at SLOT.
+ */
+static
+int
+swap_io(unsigned slot, struct iovec *iov, unsigned n, enum uio_rw rw)
+{
+	struct uio ku;
+	int result;
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)slot * PAGE_SIZE;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result == 0 && ku.uio_resid != 0) {
+		result = EIO;
+	}
+	return result;
+}
+
+int
+swap_in(unsigned slot, paddr_t paddr)
+{
+	struct iovec iov;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+
+	iov.iov_kbase = (void *)PADDR_TO_KVADDR(paddr);
+	iov.iov_len = PAGE_SIZE;
+	result = swap_io(slot, &iov, 1, UIO_READ);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&swap_lock);
+	swap_pageins++;
+	spinlock_release(&swap_lock);
+	return 0;
+}
+
+void
+swap_wait(void)
+{
+	if (swap_wchan == NULL) {
+		return;
+	}
+	spinlock_acquire(&swap_lock);
+	while (swap_pager != NULL && swap_pager != curthread) {
+		wchan_sleep(swap_wchan, &swap_lock);
+	}
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Step 2 above: claim victim V for pageout. Returns false if its
+ * page is no longer a private resident page of its owner.
+ */
+static
+bool
+swap_claim(struct coremap_victim *v)
+{
+	struct addrspace *as = v->cv_as;
+	uint32_t gen;
+	pte_t *pte;
+
+	spinlock_acquire(&as->as_ptlock);
+	pte = pt_lookup(as->as_pt, v->cv_vaddr, false);
+	if (pte == NULL ||
+	    (*pte & ~SWAP_KEEPBITS) != (v->cv_paddr | PTE_VALID)) {
+		spinlock_release(&as->as_ptlock);
+		return false;
+	}
+	*pte = v->cv_paddr | PTE_EVICTING | (*pte & SWAP_KEEPBITS);
+	gen = as->as_gen;
+	spinlock_release(&as->as_ptlock);
+
+	mmu_shootdown(gen, v->cv_vaddr, 1);
+	return true;
+}
+
+/*
+ * Step 4 above: victim V has been written to SLOT (if OK), or could
+ * not be written. Returns true if the page now lives in SLOT and the
+ * frame has been released; otherwise the caller still owns SLOT.
+ */
+static
+bool
+swap_finish(struct coremap_victim *v, unsigned slot, bool ok)
+{
+	struct addrspace *as = v->cv_as;
+	bool done = false;
+	pte_t *pte;
+
+	spinlock_acquire(&as->as_ptlock);
+	pte = pt_lookup(as->as_pt, v->cv_vaddr, false);
+	KASSERT(pte != NULL);
+	if ((*pte & ~SWAP_KEEPBITS) != (v->cv_paddr | PTE_EVICTING)) {
+		/* Owner let go of the page meanwhile. */
+	}
+	else if (ok) {
+		*pte = PTE_MKSWAP(slot);
+		coremap_free(v->cv_paddr);
+		done = true;
+	}
+	else {
+		/* Put it back. */
+		*pte = v->cv_paddr | PTE_VALID | (*pte & SWAP_KEEPBITS);
+	}
+	spinlock_release(&as->as_ptlock);
+	return done;
+}
+
+unsigned
+swap_evict(void)
+{
+	struct coremap_victim victims[SWAP_CLUSTER];
+	struct iovec iov[SWAP_CLUSTER];
+	unsigned i, j, n, len, slot, nfreed;
+	int result;
+
+	if (swap_vnode == NULL) {
+		return 0;
+	}
+
+	spinlock_acquire(&swap_lock);
+	if (swap_pager == curthread) {
+		/* Allocating memory while paging out; can't recurse. */
+		spinlock_release(&swap_lock);
+		return 0;
+	}
+	while (swap_pager != NULL) {
+		wchan_sleep(swap_wchan, &swap_lock);
+	}
+	swap_pager = curthread;
+	spinlock_release(&swap_lock);
+
+	n = coremap_pickvictims(victims, SWAP_CLUSTER);
+
+	/* Unmap them, dropping any we lost a race for. */
+	for (i=j=0; i<n; i++) {
+		if (swap_claim(&victims[i])) {
+			victims[j++] = victims[i];
+		}
+		else {
+			coremap_unpick(victims[i].cv_paddr);
+		}
+	}
+	n = j;
+
+	/* Write them out in runs of consecutive slots. */
+	nfreed = 0;
+	for (i=0; i<n; i+=len) {
+		len = swap_alloc(n - i, &slot);
+		if (len == 0) {
+			break;
+		}
+		for (j=0; j<len; j++) {
+			iov[j].iov_kbase =
+				(void *)PADDR_TO_KVADDR(victims[i+j].cv_paddr);
+			iov[j].iov_len = PAGE_SIZE;
+		}
+		result = swap_io(slot, iov, len, UIO_WRITE);
+		if (result) {
+			kprintf("swap: write error: %s\n", strerror(result));
+		}
+		for (j=0; j<len; j++) {
+			if (swap_finish(&victims[i+j], slot + j,
+					result == 0)) {
+				nfreed++;
+			}
+			else {
+				swap_free(slot + j);
+			}
+			coremap_unpick(victims[i+j].cv_paddr);
+		}
+		if (result == 0) {
+			spinlock_acquire(&swap_lock);
+			swap_pageouts += len;
+			swap_clusters++;
+			spinlock_release(&swap_lock);
+		}
+	}
+	for (; i<n; i++) {
+		/* Out of swap; restore the rest. */
+		swap_finish(&victims[i], 0, false);
+		coremap_unpick(victims[i].cv_paddr);
+	}
+
+	spinlock_acquire(&swap_lock);
+	swap_pager = NULL;
+	wchan_wakeall(swap_wchan, &swap_lock);
+	spinlock_release(&swap_lock);
+
+	return nfreed;
+}
+
+void
+swap_printstats(void)
+{
+	if (swap_vnode == NULL) {
+		kprintf("swap: none\n");
+		return;
+	}
+	spinlock_acquire(&swap_lock);
+	kprintf("swap: %u of %u pages free, %u pages out in %u writes, "
+		"%u pages in\n", swap_nfree, swap_nslots, swap_pageouts,
+		swap_clusters, swap_pageins);
+	spinlock_release(&swap_lock);
+}
@@ -0,0 +1,803 @@
+/*
+ * VM system: bootstrap, kernel page allocation, and page faults.
+ *
+ * Note! If OPT_DUMBVM is set this file is not compiled; dumbvm.c
+ * provides these functions instead.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vnode.h>
+#include <cpu.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <pagecache.h>
+#include <swap.h>
+#include <zeropage.h>
+#include <objcache.h>
+#include <vm.h>
+
+/* Pageouts to attempt for one kernel allocation */
+#define VM_KPAGES_TRIES	8
+
+/* Fault-around window, in pages; 0 if off */
+static unsigned vm_faultaround_pages = VM_FAULTAROUND_DEFAULT;
+
+/* Fault-around statistics, under vm_statlock */
+static struct spinlock vm_statlock = SPINLOCK_INITIALIZER;
+static unsigned vs_seqfaults;		/* Faults found to be sequential */
+static unsigned vs_prefetched;		/* Pages mapped ahead */
+static unsigned vs_readahead;		/* Pages read ahead from files */
+static unsigned vs_used;		/* Pages mapped ahead, then used */
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	zeropage_bootstrap();
+	swap_bootstrap();
+}
+
+/*
+ * Check if we're in a context that can sleep. Page faults and page
+ * allocation may block, so they must not be entered holding
+ * spinlocks or from an interrupt handler.
+ */
+static
+void
+vm_can_sleep(void)
+{
+	if (CURCPU_EXISTS()) {
+		/* must not hold spinlocks */
+		KASSERT(curcpu->c_spinlocks == 0);
+
+		/* must not be in an interrupt handler */
+		KASSERT(curthread->t_in_interrupt == 0);
+	}
+}
+
+/*
+ * Free up some memory: first the pool of pre-zeroed pages, unused
+ * object cache slabs and unused page cache pages, which cost nothing
+ * to drop, then user pages by paging them out. Returns false if
+ * nothing could be freed.
+ */
+static
+bool
+vm_reclaim(void)
+{
+	if (zeropage_drain(SWAP_CLUSTER) > 0) {
+		return true;
+	}
+	if (objcache_reclaim() > 0) {
+		return true;
+	}
+	if (pagecache_reclaim(SWAP_CLUSTER) > 0) {
+		return true;
+	}
+	return swap_evict() > 0;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+	unsigned tries = 0;
+
+	vm_can_sleep();
+	while ((pa = coremap_alloc(npages)) == 0) {
+		/*
+		 * Free something and try again. For more than one
+		 * page this only helps if the frames freed happen to
+		 * merge into a big enough block, so don't keep at it.
+		 */
+		if (!vm_reclaim() || ++tries > VM_KPAGES_TRIES) {
+			return 0;
+		}
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	mmu_tlbshootdown(ts);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	mmu_flush();
+}
+
+/*
+ * Idle-time work: keep the pool of pre-zeroed pages topped up.
+ */
+bool
+vm_idle(void)
+{
+	return zeropage_refill();
+}
+
+/*
+ * Get a frame for a user page, reclaiming memory if it is full.
+ * Returns 0 if there is nothing left to reclaim.
+ */
+static
+paddr_t
+vm_getframe(void)
+{
+	paddr_t paddr;
+
+	while ((paddr = coremap_alloc(1)) == 0) {
+		if (!vm_reclaim()) {
+			return 0;
+		}
+	}
+	return paddr;
+}
+
+/*
+ * Get a zero-filled frame for a user page: from the pool if the idle
+ * loop has left one there, otherwise zero one now.
+ */
+static
+paddr_t
+vm_getzeroframe(void)
+{
+	paddr_t paddr;
+
+	paddr = zeropage_alloc();
+	if (paddr == 0) {
+		paddr = vm_getframe();
+		if (paddr != 0) {
+			bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		}
+	}
+	return paddr;
+}
+
+/*
+ * Install the resident page PADDR at VADDR in AS, make it pageable,
+ * and load it into the TLB. Unless WRITABLE, the page is mapped
+ * without the dirty bit and marked PTE_RDONLY, so it stays read-only.
+ */
+static
+void
+vm_install(struct addrspace *as, pte_t *pte, vaddr_t vaddr, paddr_t paddr,
+	   bool writable)
+{
+	spinlock_acquire(&as->as_ptlock);
+	*pte = paddr | PTE_VALID | (writable ? 0 : PTE_RDONLY);
+	coremap_setowner(paddr, as, vaddr);
+	mmu_map(vaddr, paddr, writable);
+	spinlock_release(&as->as_ptlock);
+}
+
+/*
+ * Install the page PADDR, shared with the page cache and perhaps
+ * other address spaces, at VADDR in AS. If WRITABLE (a shared
+ * mapping) writes go straight to the shared page; otherwise it is
+ * read-only and copy-on-write.
+ */
+static
+void
+vm_installshared(struct addrspace *as, pte_t *pte, vaddr_t vaddr,
+		 paddr_t paddr, bool writable)
+{
+	spinlock_acquire(&as->as_ptlock);
+	*pte = paddr | PTE_VALID | (writable ? 0 : PTE_COW);
+	mmu_map(vaddr, paddr, writable);
+	spinlock_release(&as->as_ptlock);
+}
+
+/*
+ * Return true if ENTRY is a copy-on-write page that nobody else refers
+ * to any more: the other side of a fork exited or made its own copy.
+ * Such a page is private again, but shared frames have no owner in the
+ * coremap, so until it's taken over (see vm_pagein) it can't be paged
+ * out. Called with as_ptlock held.
+ */
+static
+bool
+vm_cowprivate(pte_t entry)
+{
+	paddr_t paddr = entry & PTE_FRAME;
+
+	return (entry & PTE_COW) != 0 && !zeropage_is(paddr) &&
+		coremap_refcount(paddr) == 1;
+}
+
+/*
+ * Make the copy-on-write page at VADDR, with entry ENTRY, private to
+ * this address space. If nobody else refers to the frame any more we
+ * can just take it over; otherwise copy it and drop our reference to
+ * the shared one.
+ *
+ * Shared frames are never paged out, so the entry can't change while
+ * we aren't holding as_ptlock. This is only reached on writes, which
+ * vm_fault has already checked the region allows.
+ */
+static
+int
+vm_unshare(struct addrspace *as, pte_t *pte, vaddr_t vaddr, pte_t entry)
+{
+	paddr_t oldpa, newpa;
+
+	KASSERT(entry & PTE_VALID);
+	KASSERT(entry & PTE_COW);
+
+	oldpa = entry & PTE_FRAME;
+	if (zeropage_is(oldpa)) {
+		/* First write to a zero-fill page; nothing to copy. */
+		newpa = vm_getzeroframe();
+		if (newpa == 0) {
+			return ENOMEM;
+		}
+		vm_install(as, pte, vaddr, newpa, true);
+		return 0;
+	}
+	if (coremap_refcount(oldpa) == 1) {
+		vm_install(as, pte, vaddr, oldpa, true);
+		return 0;
+	}
+
+	newpa = vm_getframe();
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	vm_install(as, pte, vaddr, newpa, true);
+	coremap_free(oldpa);
+
+	return 0;
+}
+
+/*
+ * Bring the page at VADDR, with entry ENTRY, back in from swap. Only
+ * this address space's own thread changes a swapped entry, so it
+ * can't change while the read is in progress.
+ */
+static
+int
+vm_swapin(struct addrspace *as, struct region *rg, pte_t *pte, vaddr_t vaddr,
+	  pte_t entry)
+{
+	paddr_t paddr;
+	int result;
+
+	KASSERT(entry & PTE_SWAPPED);
+
+	paddr = vm_getframe();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	result = swap_in(PTE_SLOT(entry), paddr);
+	if (result) {
+		coremap_free(paddr);
+		return result;
+	}
+	vm_install(as, pte, vaddr, paddr, (rg->rg_flags & RG_WRITE) != 0);
+	swap_free(PTE_SLOT(entry));
+
+	return 0;
+}
+
+/*
+ * Return true if none of the page at VADDR in region RG comes from
+ * the region's file, so that it starts out all zero.
+ */
+static
+bool
+vm_zerofill(struct region *rg, vaddr_t vaddr)
+{
+	return rg->rg_vnode == NULL ||
+		vaddr + PAGE_SIZE <= rg->rg_filestart ||
+		vaddr >= rg->rg_fileend;
+}
+
+/*
+ * Fill the new frame PADDR with the initial contents of the page at
+ * VADDR in region RG: whatever part of it is backed by the region's
+ * file is read from the file, and the rest is zeroed.
+ */
+static
+int
+vm_fillpage(struct region *rg, vaddr_t vaddr, paddr_t paddr)
+{
+	char *kpage = (char *)PADDR_TO_KVADDR(paddr);
+	vaddr_t start, end;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	start = vaddr;
+	end = vaddr + PAGE_SIZE;
+	if (vm_zerofill(rg, vaddr)) {
+		/* Nothing from the file (e.g. BSS); demand-zero. */
+		bzero(kpage, PAGE_SIZE);
+		return 0;
+	}
+
+	if (start < rg->rg_filestart) {
+		start = rg->rg_filestart;
+	}
+	if (end > rg->rg_fileend) {
+		end = rg->rg_fileend;
+	}
+	bzero(kpage, start - vaddr);
+	bzero(kpage + (end - vaddr), vaddr + PAGE_SIZE - end);
+
+	uio_kinit(&iov, &ku, kpage + (start - vaddr), end - start,
+		  rg->rg_fileoff + (start - rg->rg_filestart), UIO_READ);
+	result = VOP_READ(rg->rg_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* The file shrank since as_define_file checked it. */
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Read fault on a page of RG that lies wholly within its file-backed
+ * part, at page-aligned file offset OFFSET. Such pages are kept in the
+ * page cache and mapped shared, so every process running the same
+ * program uses the same frame for each page of its text.
+ */
+static
+int
+vm_faultcached(struct addrspace *as, struct region *rg, pte_t *pte,
+	       vaddr_t vaddr, off_t offset)
+{
+	paddr_t paddr;
+	int result;
+
+	result = VOP_MMAP(rg->rg_vnode, offset, &paddr);
+	if (result) {
+		return result;
+	}
+	vm_installshared(as, pte, vaddr, paddr, false);
+	return 0;
+}
+
+/*
+ * Fault on a page of a MAP_SHARED region. The page cache page itself
+ * is mapped. If the region is writable it's counted dirty from now
+ * on and written back when the mapping goes away.
+ */
+static
+int
+vm_faultshared(struct addrspace *as, struct region *rg, pte_t *pte,
+	       vaddr_t vaddr)
+{
+	paddr_t paddr;
+	off_t offset;
+	int result;
+
+	offset = rg->rg_fileoff + (vaddr - rg->rg_filestart);
+	result = VOP_MMAP(rg->rg_vnode, offset, &paddr);
+	if (result) {
+		return result;
+	}
+	if (rg->rg_flags & RG_WRITE) {
+		pagecache_markdirty(rg->rg_vnode, offset);
+		vm_installshared(as, pte, vaddr, paddr, true);
+	}
+	else {
+		vm_installshared(as, pte, vaddr, paddr, false);
+	}
+	return 0;
+}
+
+void
+vm_setfaultaround(unsigned npages)
+{
+	if (npages > VM_FAULTAROUND_MAX) {
+		npages = VM_FAULTAROUND_MAX;
+	}
+	vm_faultaround_pages = npages;
+}
+
+unsigned
+vm_getfaultaround(void)
+{
+	return vm_faultaround_pages;
+}
+
+void
+vm_printstats(void)
+{
+	spinlock_acquire(&vm_statlock);
+	kprintf("faultaround: window %u, %u sequential faults, "
+		"%u pages mapped ahead (%u read ahead), %u used\n",
+		vm_faultaround_pages, vs_seqfaults, vs_prefetched,
+		vs_readahead, vs_used);
+	spinlock_release(&vm_statlock);
+}
+
+/*
+ * If the page at VADDR was mapped ahead and not yet counted as used,
+ * count it now. Returns 1 if so, else 0.
+ */
+static
+unsigned
+vm_prefetchused(struct addrspace *as, vaddr_t vaddr)
+{
+	pte_t *pte;
+	unsigned used = 0;
+
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte == NULL) {
+		return 0;
+	}
+	spinlock_acquire(&as->as_ptlock);
+	if (*pte & PTE_PREFETCH) {
+		*pte &= ~(pte_t)PTE_PREFETCH;
+		used = 1;
+	}
+	spinlock_release(&as->as_ptlock);
+	return used;
+}
+
+/*
+ * Map the page at VADDR in RG ahead of use, if that's cheap or it's
+ * worth reading ahead. Resident pages just go into the TLB. Missing
+ * pages of a private file mapping are brought into the page cache
+ * and mapped copy-on-write, as vm_faultcached would on a read fault.
+ * Missing pages of a shared mapping are only brought into the cache,
+ * since mapping them would count them as dirty. Zero-fill and
+ * paged-out pages are left alone. Returns 1 if the page was mapped,
+ * else 0; sets *READAHEAD if it was read from the file.
+ */
+static
+unsigned
+vm_prefetchpage(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+		bool *readahead)
+{
+	pte_t *pte, entry;
+	paddr_t paddr;
+	off_t offset;
+
+	*readahead = false;
+
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte != NULL) {
+		spinlock_acquire(&as->as_ptlock);
+		entry = *pte;
+		if (entry & PTE_VALID) {
+			*pte = entry | PTE_PREFETCH;
+			mmu_map(vaddr, entry & PTE_FRAME,
+				PTE_WRITABLE(entry));
+			spinlock_release(&as->as_ptlock);
+			return (entry & PTE_PREFETCH) ? 0 : 1;
+		}
+		spinlock_release(&as->as_ptlock);
+		if (entry != 0) {
+			return 0;
+		}
+	}
+
+	if (rg->rg_vnode == NULL || vaddr < rg->rg_filestart ||
+	    vaddr + PAGE_SIZE > rg->rg_fileend) {
+		return 0;
+	}
+	offset = rg->rg_fileoff + (vaddr - rg->rg_filestart);
+	if (offset % PAGE_SIZE != 0) {
+		return 0;
+	}
+
+	if (rg->rg_flags & RG_SHARED) {
+		if (VOP_MMAP(rg->rg_vnode, offset, &paddr) == 0) {
+			coremap_free(paddr);
+			*readahead = true;
+		}
+		return 0;
+	}
+
+	pte = pt_lookup(as->as_pt, vaddr, true);
+	if (pte == NULL || vm_faultcached(as, rg, pte, vaddr, offset)) {
+		return 0;
+	}
+	spinlock_acquire(&as->as_ptlock);
+	*pte |= PTE_PREFETCH;
+	spinlock_release(&as->as_ptlock);
+	*readahead = true;
+	return 1;
+}
+
+/*
+ * Fault-around, after a successful slow-path fault on VADDR in region
+ * RG. Plain TLB misses on resident pages don't come here: they would
+ * pay for a region lookup every time, and a page prefetched earlier
+ * that was used before any slow fault got to it is counted by the
+ * scan below anyway.
+ *
+ * A fault counts as sequential if it's above the region's previous
+ * fault by no more than the window plus one page: after mapping a
+ * window ahead, the next fault of a sequential scan lands just past
+ * it. The pages in between were then presumably used.
+ */
+static
+void
+vm_faultaround(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	unsigned window, i, used, prefetched, readahead;
+	vaddr_t last, va, top;
+	bool ra;
+
+	window = vm_faultaround_pages;
+	if (window == 0) {
+		return;
+	}
+	last = rg->rg_lastfault;
+	rg->rg_lastfault = vaddr;
+
+	/* A page mapped ahead whose TLB entry was lost before use. */
+	used = vm_prefetchused(as, vaddr);
+
+	if (vaddr <= last || vaddr - last > (window + 1) * PAGE_SIZE) {
+		if (used > 0) {
+			spinlock_acquire(&vm_statlock);
+			vs_used += used;
+			spinlock_release(&vm_statlock);
+		}
+		return;
+	}
+
+	for (va = last + PAGE_SIZE; va < vaddr; va += PAGE_SIZE) {
+		used += vm_prefetchused(as, va);
+	}
+
+	prefetched = readahead = 0;
+	top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	for (i=1; i<=window && vaddr + i * PAGE_SIZE < top; i++) {
+		prefetched += vm_prefetchpage(as, rg, vaddr + i * PAGE_SIZE,
+					      &ra);
+		if (ra) {
+			readahead++;
+		}
+	}
+
+	spinlock_acquire(&vm_statlock);
+	vs_seqfaults++;
+	vs_prefetched += prefetched;
+	vs_readahead += readahead;
+	vs_used += used;
+	spinlock_release(&vm_statlock);
+}
+
+/*
+ * Slow path of vm_fault: make the page at FAULTADDRESS in region RG
+ * resident and accessible for FAULTTYPE, and load it into the TLB.
+ */
+static
+int
+vm_pagein(struct addrspace *as, struct region *rg, int faulttype,
+	  vaddr_t faultaddress)
+{
+	pte_t *pte, entry;
+	paddr_t paddr;
+	int result;
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	/*
+	 * A read-only fault on a page that isn't resident any more
+	 * (it was paged out after the TLB miss was taken) is handled
+	 * like any other write.
+	 */
+
+	for (;;) {
+		spinlock_acquire(&as->as_ptlock);
+		entry = *pte;
+		if ((entry & PTE_VALID) && faulttype == VM_FAULT_READ &&
+		    vm_cowprivate(entry)) {
+			/* Take it over, as vm_unshare would on a write. */
+			spinlock_release(&as->as_ptlock);
+			vm_install(as, pte, faultaddress, entry & PTE_FRAME,
+				   (rg->rg_flags & RG_WRITE) != 0);
+			return 0;
+		}
+		if ((entry & PTE_VALID) &&
+		    (faulttype == VM_FAULT_READ || PTE_WRITABLE(entry))) {
+			/* Lost a race with another fault; just map it. */
+			paddr = entry & PTE_FRAME;
+			coremap_touch(paddr);
+			mmu_map(faultaddress, paddr, PTE_WRITABLE(entry));
+			spinlock_release(&as->as_ptlock);
+			return 0;
+		}
+		spinlock_release(&as->as_ptlock);
+
+		if ((entry & PTE_EVICTING) == 0) {
+			break;
+		}
+		swap_wait();
+	}
+
+	if (entry & PTE_VALID) {
+		/*
+		 * Write to a shared page, either through a read-only
+		 * TLB entry or on a TLB miss. Copy it now rather than
+		 * mapping it read-only and taking another fault.
+		 */
+		return vm_unshare(as, pte, faultaddress, entry);
+	}
+	if (entry & PTE_SWAPPED) {
+		return vm_swapin(as, rg, pte, faultaddress, entry);
+	}
+
+	/*
+	 * First touch. Shared mappings always use the page cache page.
+	 * Otherwise, reading a whole page of file goes through the page
+	 * cache. (Writes would only copy the cached page straight away,
+	 * so they don't.)
+	 */
+	KASSERT(entry == 0);
+	if (rg->rg_flags & RG_SHARED) {
+		return vm_faultshared(as, rg, pte, faultaddress);
+	}
+	if (faulttype == VM_FAULT_READ && rg->rg_vnode != NULL &&
+	    faultaddress >= rg->rg_filestart &&
+	    faultaddress + PAGE_SIZE <= rg->rg_fileend) {
+		off_t offset;
+
+		offset = rg->rg_fileoff + (faultaddress - rg->rg_filestart);
+		if (offset % PAGE_SIZE == 0) {
+			return vm_faultcached(as, rg, pte, faultaddress,
+					      offset);
+		}
+	}
+
+	/*
+	 * Zero-fill pages are mapped to the shared zero frame until
+	 * they are written; vm_unshare gives them a frame of their own.
+	 */
+	if (vm_zerofill(rg, faultaddress)) {
+		if (faulttype == VM_FAULT_READ) {
+			vm_installshared(as, pte, faultaddress,
+					 zeropage_map(), false);
+			return 0;
+		}
+		paddr = vm_getzeroframe();
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		vm_install(as, pte, faultaddress, paddr, true);
+		return 0;
+	}
+
+	/* Otherwise read from the file. */
+	paddr = vm_getframe();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	result = vm_fillpage(rg, faultaddress, paddr);
+	if (result) {
+		coremap_free(paddr);
+		return result;
+	}
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	vm_install(as, pte, faultaddress, paddr,
+		   (rg->rg_flags & RG_WRITE) != 0);
+
+	return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	pte_t *pte, entry;
+	paddr_t paddr;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	vm_can_sleep();
+
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	/*
+	 * Fast path: a plain TLB miss on a resident page. Pages are
+	 * only ever resident inside a region, so there's no need to
+	 * look at the region list. The entry is loaded into the TLB
+	 * while holding as_ptlock so a pageout can't slip in between.
+	 * A copy-on-write page that has become private goes the slow
+	 * way, to be taken over.
+	 */
+	pte = pt_lookup(as->as_pt, faultaddress, false);
+	if (pte != NULL) {
+		spinlock_acquire(&as->as_ptlock);
+		entry = *pte;
+		if ((entry & PTE_VALID) &&
+		    (faulttype == VM_FAULT_READ || PTE_WRITABLE(entry)) &&
+		    !vm_cowprivate(entry)) {
+			paddr = entry & PTE_FRAME;
+			coremap_touch(paddr);
+			mmu_map(faultaddress, paddr, PTE_WRITABLE(entry));
+			spinlock_release(&as->as_ptlock);
+			return 0;
+		}
+		spinlock_release(&as->as_ptlock);
+	}
+
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL) {
+		rg = as_growstack(as, faultaddress);
+		if (rg == NULL) {
+			return EFAULT;
+		}
+	}
+
+	/*
+	 * Check the region's permissions. Reads include instruction
+	 * fetches; the MIPS can't tell them apart.
+	 */
+	if (faulttype == VM_FAULT_READ) {
+		if ((rg->rg_flags & (RG_READ | RG_EXEC)) == 0) {
+			return EFAULT;
+		}
+	}
+	else if ((rg->rg_flags & RG_WRITE) == 0) {
+		return EFAULT;
+	}
+
+	result = vm_pagein(as, rg, faulttype, faultaddress);
+	if (result == 0) {
+		vm_faultaround(as, rg, faultaddress);
+	}
+	return result;
+}
@@ -0,0 +1,132 @@
+/*
+ * Shared zero frame and pre-zeroed page pool. See zeropage.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <coremap.h>
+#include <zeropage.h>
+
+static paddr_t zero_frame;		/* 0 until bootstrap */
+
+static struct spinlock zeropool_lock = SPINLOCK_INITIALIZER;
+static paddr_t zeropool[ZEROPAGE_POOLMAX];
+static unsigned zeropool_count;
+
+/* Statistics */
+static unsigned zp_maps;		/* Pages mapped to the zero frame */
+static unsigned zp_hits;		/* Allocations served from the pool */
+static unsigned zp_misses;		/* Allocations that found it empty */
+static unsigned zp_refills;		/* Pages zeroed by the idle loop */
+
+void
+zeropage_bootstrap(void)
+{
+	zero_frame = coremap_alloc(1);
+	if (zero_frame == 0) {
+		panic("zeropage: no memory for the zero frame\n");
+	}
+	bzero((void *)PADDR_TO_KVADDR(zero_frame), PAGE_SIZE);
+}
+
+paddr_t
+zeropage_map(void)
+{
+	KASSERT(zero_frame != 0);
+
+	/* Unlocked; it's only a statistic. */
+	zp_maps++;
+	return zero_frame;
+}
+
+bool
+zeropage_is(paddr_t paddr)
+{
+	return paddr == zero_frame;
+}
+
+paddr_t
+zeropage_alloc(void)
+{
+	paddr_t paddr = 0;
+
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_count > 0) {
+		paddr = zeropool[--zeropool_count];
+		zp_hits++;
+	}
+	else {
+		zp_misses++;
+	}
+	spinlock_release(&zeropool_lock);
+
+	return paddr;
+}
+
+bool
+zeropage_refill(void)
+{
+	paddr_t paddr;
+	bool full;
+
+	if (zero_frame == 0) {
+		/* Not bootstrapped yet. */
+		return false;
+	}
+
+	/* Unlocked peek; being off by one either way is harmless. */
+	if (zeropool_count >= ZEROPAGE_POOLMAX) {
+		return false;
+	}
+
+	paddr = coremap_alloc(1);
+	if (paddr == 0) {
+		return false;
+	}
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+	spinlock_acquire(&zeropool_lock);
+	full = zeropool_count >= ZEROPAGE_POOLMAX;
+	if (!full) {
+		zeropool[zeropool_count++] = paddr;
+		zp_refills++;
+	}
+	spinlock_release(&zeropool_lock);
+
+	if (full) {
+		/* Another cpu filled it meanwhile. */
+		coremap_free(paddr);
+		return false;
+	}
+	return true;
+}
+
+unsigned
+zeropage_drain(unsigned max)
+{
+	paddr_t pages[ZEROPAGE_POOLMAX];
+	unsigned i, n = 0;
+
+	spinlock_acquire(&zeropool_lock);
+	while (n < max && zeropool_count > 0) {
+		pages[n++] = zeropool[--zeropool_count];
+	}
+	spinlock_release(&zeropool_lock);
+
+	for (i=0; i<n; i++) {
+		coremap_free(pages[i]);
+	}
+	return n;
+}
+
+void
+zeropage_printstats(void)
+{
+	spinlock_acquire(&zeropool_lock);
+	kprintf("zeropage: %u zero-frame mappings, pool %u/%u, "
+		"%u hits, %u misses, %u zeroed while idle\n",
+		zp_maps, zeropool_count, ZEROPAGE_POOLMAX,
+		zp_hits, zp_misses, zp_refills);
+	spinlock_release(&zeropool_lock);
+}
@@ -0,0 +1,23 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+/*
+ * Get the PROT_* and MAP_* flags from the kernel.
+ */
+#include <kern/mman.h>
+
+/* Returned by mmap on failure */
+#define MAP_FAILED ((void *)-1)
+
+/*
+ * Map files into memory. ADDR is only a hint and is currently
+ * ignored; OFFSET must be a multiple of the page size. munmap must
+ * be given exactly a region returned by mmap.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+
+#endif /* _SYS_MMAN_H_ */